@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/**
+ * Allocator handing out memory aligned to the given boundary.
+ * Aligning arrays to cache lines allows the compiler to use aligned
+ * vector loads and stores and avoids split cache line accesses.
+ * @brief Allocator for aligned memory.
+ */
+template <typename T, size_t alignment = 64>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind
+	{
+		typedef AlignedAllocator<U, alignment> other;
+	};
+
+	AlignedAllocator() noexcept = default;
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, alignment> &) noexcept {}
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignment)));
+	}
+
+	void deallocate(T *p, size_t) noexcept
+	{
+		::operator delete(p, std::align_val_t(alignment));
+	}
+
+	template <typename U>
+	bool operator==(const AlignedAllocator<U, alignment> &) const noexcept
+	{
+		return true;
+	}
+};
+
+// Vector whose data is aligned to a cache line.
+template <typename T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
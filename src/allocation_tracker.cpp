@@ -0,0 +1,251 @@
+#include "allocation_tracker.h"
+
+/**
+ * @returns The name of the region, for reports.
+ */
+const char *get_allocation_region_name(AllocationRegion region)
+{
+	switch (region)
+	{
+	case UNSCOPED:
+		return "other";
+	case INTEGRATION:
+		return "integration";
+	case SPRINGS:
+		return "springs";
+	case BROAD_PHASE:
+		return "broad phase";
+	case COLLISION:
+		return "collision";
+	case VELOCITIES:
+		return "velocities";
+	case NORMALS:
+		return "normals";
+	case UPLOAD:
+		return "upload";
+	default:
+		return "unknown";
+	}
+}
+
+#ifdef TRACK_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	struct RegionCounters
+	{
+		std::atomic<unsigned long long> allocations;
+		std::atomic<unsigned long long> bytes;
+		std::atomic<unsigned long long> deallocations;
+	};
+
+	// Constant initialized, so they are usable by allocations before main.
+	RegionCounters region_counters[ALLOCATION_REGION_COUNT];
+	thread_local AllocationRegion current_region = UNSCOPED;
+
+	/**
+	 * @brief Allocate from the C heap and count the allocation.
+	 * Calls the new handler until the allocation succeeds, like the default operator new.
+	 *
+	 * @param size The size of the allocation in bytes
+	 * @param alignment The alignment of the allocation, a power of two
+	 * @return void* The memory, or nullptr if there is no new handler left to free memory
+	 */
+	void *tracked_allocate(size_t size, size_t alignment)
+	{
+		if (size == 0)
+			size = 1;
+
+		while (true)
+		{
+			void *memory = nullptr;
+			if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+				memory = std::malloc(size);
+			else
+			{
+#if defined(_WIN32)
+				memory = _aligned_malloc(size, alignment);
+#else
+				if (posix_memalign(&memory, alignment, size) != 0)
+					memory = nullptr;
+#endif
+			}
+
+			if (memory != nullptr)
+			{
+				RegionCounters &counters = region_counters[current_region];
+				counters.allocations.fetch_add(1, std::memory_order_relaxed);
+				counters.bytes.fetch_add(size, std::memory_order_relaxed);
+				return memory;
+			}
+
+			std::new_handler handler = std::get_new_handler();
+			if (handler == nullptr)
+				return nullptr;
+			handler();
+		}
+	}
+
+	/**
+	 * @brief Return memory of tracked_allocate() to the C heap and count it.
+	 *
+	 * @param memory The memory, may be nullptr
+	 * @param alignment The alignment it was allocated with
+	 */
+	void tracked_deallocate(void *memory, size_t alignment) noexcept
+	{
+		if (memory == nullptr)
+			return;
+		region_counters[current_region].deallocations.fetch_add(1, std::memory_order_relaxed);
+
+		if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			std::free(memory);
+		else
+		{
+#if defined(_WIN32)
+			_aligned_free(memory);
+#else
+			std::free(memory);
+#endif
+		}
+	}
+
+	void *throwing_allocate(size_t size, size_t alignment)
+	{
+		void *memory = tracked_allocate(size, alignment);
+		if (memory == nullptr)
+			throw std::bad_alloc();
+		return memory;
+	}
+
+	void *nothrow_allocate(size_t size, size_t alignment) noexcept
+	{
+		try
+		{
+			return tracked_allocate(size, alignment);
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
+	}
+}
+
+/**
+ * @returns The region the allocations of the calling thread are attributed to.
+ */
+AllocationRegion get_allocation_region()
+{
+	return current_region;
+}
+
+/**
+ * @returns The allocations made within the region since the last reset, by all threads.
+ */
+AllocationCounts get_allocation_counts(AllocationRegion region)
+{
+	const RegionCounters &counters = region_counters[region];
+	AllocationCounts counts;
+	counts.allocations = counters.allocations.load(std::memory_order_relaxed);
+	counts.bytes = counters.bytes.load(std::memory_order_relaxed);
+	counts.deallocations = counters.deallocations.load(std::memory_order_relaxed);
+	return counts;
+}
+
+/**
+ * @returns The allocations of all regions together since the last reset.
+ */
+AllocationCounts get_total_allocation_counts()
+{
+	AllocationCounts total;
+	for (int region = 0; region < ALLOCATION_REGION_COUNT; region++)
+	{
+		AllocationCounts counts = get_allocation_counts(static_cast<AllocationRegion>(region));
+		total.allocations += counts.allocations;
+		total.bytes += counts.bytes;
+		total.deallocations += counts.deallocations;
+	}
+	return total;
+}
+
+/**
+ * @brief Set the counts of all regions to 0, e.g. at the start of a frame.
+ */
+void reset_allocation_counts()
+{
+	for (RegionCounters &counters : region_counters)
+	{
+		counters.allocations.store(0, std::memory_order_relaxed);
+		counters.bytes.store(0, std::memory_order_relaxed);
+		counters.deallocations.store(0, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * @brief Count an allocation that bypasses operator new into the region of the calling thread.
+ *
+ * @param bytes The size of the allocation
+ */
+void track_allocation(size_t bytes)
+{
+	RegionCounters &counters = region_counters[current_region];
+	counters.allocations.fetch_add(1, std::memory_order_relaxed);
+	counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Count the release of memory counted with track_allocation().
+ */
+void track_deallocation()
+{
+	region_counters[current_region].deallocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Construct a new Allocation Scope:: Allocation Scope object
+ *
+ * @param region The region the allocations of this thread count to until the scope ends
+ */
+AllocationScope::AllocationScope(AllocationRegion region)
+{
+	previous = current_region;
+	current_region = region;
+}
+
+/**
+ * @brief Destroy the Allocation Scope:: Allocation Scope object
+ * The allocations count to the enclosing region again.
+ */
+AllocationScope::~AllocationScope()
+{
+	current_region = previous;
+}
+
+// Replacements of all global allocation functions, they take precedence over the
+// ones of the standard library in the whole program.
+void *operator new(size_t size) { return throwing_allocate(size, 0); }
+void *operator new[](size_t size) { return throwing_allocate(size, 0); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return nothrow_allocate(size, 0); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return nothrow_allocate(size, 0); }
+void *operator new(size_t size, std::align_val_t alignment) { return throwing_allocate(size, static_cast<size_t>(alignment)); }
+void *operator new[](size_t size, std::align_val_t alignment) { return throwing_allocate(size, static_cast<size_t>(alignment)); }
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return nothrow_allocate(size, static_cast<size_t>(alignment)); }
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return nothrow_allocate(size, static_cast<size_t>(alignment)); }
+
+void operator delete(void *memory) noexcept { tracked_deallocate(memory, 0); }
+void operator delete[](void *memory) noexcept { tracked_deallocate(memory, 0); }
+void operator delete(void *memory, size_t) noexcept { tracked_deallocate(memory, 0); }
+void operator delete[](void *memory, size_t) noexcept { tracked_deallocate(memory, 0); }
+void operator delete(void *memory, const std::nothrow_t &) noexcept { tracked_deallocate(memory, 0); }
+void operator delete[](void *memory, const std::nothrow_t &) noexcept { tracked_deallocate(memory, 0); }
+void operator delete(void *memory, std::align_val_t alignment) noexcept { tracked_deallocate(memory, static_cast<size_t>(alignment)); }
+void operator delete[](void *memory, std::align_val_t alignment) noexcept { tracked_deallocate(memory, static_cast<size_t>(alignment)); }
+void operator delete(void *memory, size_t, std::align_val_t alignment) noexcept { tracked_deallocate(memory, static_cast<size_t>(alignment)); }
+void operator delete[](void *memory, size_t, std::align_val_t alignment) noexcept { tracked_deallocate(memory, static_cast<size_t>(alignment)); }
+void operator delete(void *memory, std::align_val_t alignment, const std::nothrow_t &) noexcept { tracked_deallocate(memory, static_cast<size_t>(alignment)); }
+void operator delete[](void *memory, std::align_val_t alignment, const std::nothrow_t &) noexcept { tracked_deallocate(memory, static_cast<size_t>(alignment)); }
+
+#endif
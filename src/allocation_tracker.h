@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+
+// Parts of a frame the heap allocations are attributed to.
+enum AllocationRegion
+{
+	// Everything outside of a scoped region.
+	UNSCOPED,
+	INTEGRATION,
+	SPRINGS,
+	// Update of the broad phase, e.g. building the spatial hash.
+	BROAD_PHASE,
+	// Neighbor lists and collision response of the self collision.
+	COLLISION,
+	VELOCITIES,
+	// Normals and buffer uploads of the viewer.
+	NORMALS,
+	UPLOAD,
+	ALLOCATION_REGION_COUNT
+};
+
+// Heap allocations made within one region since the last reset.
+struct AllocationCounts
+{
+	unsigned long long allocations = 0;
+	unsigned long long bytes = 0;
+	unsigned long long deallocations = 0;
+};
+
+const char *get_allocation_region_name(AllocationRegion region);
+
+#ifdef TRACK_ALLOCATIONS
+
+// The global operator new and delete are replaced and count every allocation into
+// the region of the allocating thread. Only compiled with XPBD_TRACK_ALLOCATIONS.
+constexpr bool allocation_tracking_enabled = true;
+
+AllocationRegion get_allocation_region();
+AllocationCounts get_allocation_counts(AllocationRegion region);
+AllocationCounts get_total_allocation_counts();
+void reset_allocation_counts();
+// Counts memory which does not come from operator new, e.g. mapped by allocate_huge_pages().
+void track_allocation(size_t bytes);
+void track_deallocation();
+
+/**
+ * Sets the region of the current thread for its lifetime and restores the previous
+ * region afterwards, so scopes can be nested.
+ * @brief Attributes the allocations of a block to a region.
+ */
+class AllocationScope
+{
+public:
+	explicit AllocationScope(AllocationRegion region);
+	~AllocationScope();
+	AllocationScope(const AllocationScope &) = delete;
+	AllocationScope &operator=(const AllocationScope &) = delete;
+
+private:
+	AllocationRegion previous;
+};
+
+#else
+
+// Without tracking the scopes compile to nothing and all counts are 0.
+constexpr bool allocation_tracking_enabled = false;
+
+inline AllocationRegion get_allocation_region() { return UNSCOPED; }
+inline AllocationCounts get_allocation_counts(AllocationRegion) { return {}; }
+inline AllocationCounts get_total_allocation_counts() { return {}; }
+inline void reset_allocation_counts() {}
+inline void track_allocation(size_t) {}
+inline void track_deallocation() {}
+
+class AllocationScope
+{
+public:
+	explicit AllocationScope(AllocationRegion) {}
+	AllocationScope(const AllocationScope &) = delete;
+	AllocationScope &operator=(const AllocationScope &) = delete;
+};
+
+#endif
@@ -0,0 +1,8 @@
+#include "broad_phase.h"
+
+const std::array<int3, 13> BroadPhase::forward_offsets = {{
+	{1, -1, -1}, {1, -1, 0}, {1, -1, 1},
+	{1, 0, -1}, {1, 0, 0}, {1, 0, 1},
+	{1, 1, -1}, {1, 1, 0}, {1, 1, 1},
+	{0, 1, -1}, {0, 1, 0}, {0, 1, 1},
+	{0, 0, 1}}};
@@ -0,0 +1,56 @@
+#pragma once
+#include <array>
+#include <vector>
+#include "algebraic_types.h"
+#include "distance_kernel.h"
+#include "particle_store.h"
+
+class ThreadPool;
+
+// Determines how the self collision finds the particles close to each other.
+enum BroadPhaseType
+{
+	// Uniform grid whose cells are hashed into a table, see SpatialHashStructure.
+	SPATIAL_HASH,
+	// Uniform grid over the bounding box of the particles with one entry per cell,
+	// so particles of different cells never share an entry.
+	DENSE_GRID,
+	// Particles sorted along the axis of their largest extent. The partners of a
+	// particle are found by scanning forward until the cutoff is exceeded.
+	SWEEP_AND_PRUNE
+};
+
+/**
+ * Every backend is kept alive between substeps and reuses its buffers,
+ * so updating it to new particle positions rarely allocates.
+ * @brief Finds the pairs of particles closer than a cutoff for the self collision.
+ */
+class BroadPhase
+{
+public:
+	virtual ~BroadPhase() = default;
+
+	// Brings the backend up to date with the positions of the particles.
+	virtual void update(const ParticleStore &particles, ThreadPool &thread_pool) = 0;
+
+	// Appends every pair of particles not further apart than the cutoff to pairs, once.
+	// The cutoff must not exceed the cell spacing of the grid based backends.
+	virtual void collect_pairs(const ParticleStore &particles, float cutoff,
+							   std::vector<RealVector<unsigned int, 2>> &pairs) const = 0;
+
+	// Selects the instruction set of the distance tests, if the backend vectorizes them.
+	virtual void set_simd_level(SimdLevel level) { (void)level; }
+
+	// Sizes the large buffers for the particle count and backs their pages from the
+	// threads of the pool, so the first update does not page fault on them.
+	virtual void distribute(size_t particle_count, ThreadPool &thread_pool)
+	{
+		(void)particle_count;
+		(void)thread_pool;
+	}
+
+protected:
+	// Half of the 26 neighboring cells, the ones after the cell in lexicographic order.
+	// Visiting only these from every cell finds each pair of adjacent cells once.
+	static const std::array<int3, 13> forward_offsets;
+};
@@ -1,14 +1,20 @@
 #pragma once
 #include "config.h"
-#include "algebraic_types.h"
-#include "linear_algebra.h"
-#include "obj_reader.h"
-
-class ClothMesh
+#include "cloth_state.h"
+#include "phase_profiler.h"
+#include <memory_resource>
+
+/**
+ * Renderable cloth. The simulation state is inherited from ClothState,
+ * this class only adds the OpenGL buffers needed to draw it.
+ * @brief OpenGL representation of a cloth.
+ */
+class ClothMesh : public ClothState
 {
 public:
     ClothMesh(const std::string &cloth_path, vec3 color);
-    void draw();
+    void draw(std::pmr::memory_resource *frame_memory = std::pmr::get_default_resource(),
+              PhaseProfiler *profiler = nullptr);
     ~ClothMesh();
 
 private:
@@ -21,34 +27,6 @@ private:
     unsigned int EBO, VAO, element_count;
     std::vector<unsigned int> VBOs;
 
-    mutable bool vertex_positions_invalid = true;
-    std::vector<vec3> vertex_positions;
-    std::vector<uint3> triangles;
-
-    void compute_and_store_normals();
-    void compute_normals(std::vector<vec3> &out);
-
-    // Subset of unique edges, containing only straight edges
-    // meaning that diagonal edges have been removed
-    std::vector<RealVector<unsigned int, 2>> unique_springs;
-
-    // The rest distance between two nodes
-    // computed as the average edge length
-    std::vector<float> rest_distance;
-
-    // The mass of the particles.
-    std::vector<float> mass;
-
-public:
-    const std::vector<float> &get_rest_distance_ref() const;
-    const std::vector<float> &get_mass_ref() const;
-
-    std::vector<vec3> get_vertex_positions() const;
-    // this will invalidate the vertex positions array
-    void set_vertex_positions(const std::vector<vec3> &new_vertex_positions);
-
-    // topology remains unchanged, so we dont need a setter!
-    std::vector<uint3> get_triangles() const;
-    const std::vector<uint3> &get_triangles_ref() const;
-    const std::vector<RealVector<unsigned int, 2>> &get_unique_springs_ref() const;
+    void compute_and_store_normals(std::pmr::memory_resource *frame_memory, PhaseProfiler *profiler);
+    void compute_normals(std::pmr::vector<vec3> &out);
 };
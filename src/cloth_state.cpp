@@ -0,0 +1,595 @@
+#include "cloth_state.h"
+#include <cassert>
+#include <unordered_set>
+#include <cmath>
+#include <bit>
+#include <cstdint>
+#include <filesystem>
+#include <algorithm>
+
+/**
+ * @brief Construct a new Cloth State:: Cloth State object
+ *
+ * @param cloth_path external path to the cloth obj file
+ * @param ordering order of the vertices in memory
+ */
+ClothState::ClothState(const std::string &cloth_path, VertexOrdering ordering)
+{
+    auto mesh = read_obj(cloth_path);
+    std::vector<float> vertices = mesh.first;
+    std::vector<unsigned int> faces = mesh.second;
+
+    assert(vertices.size() % 3 == 0);
+    vertex_positions.reserve(vertices.size() / 3);
+    mass.reserve(vertices.size() / 3);
+    for (size_t i = 0; i < vertices.size(); i += 3)
+    {
+        vec3 v;
+        v.entries[0] = vertices[i];
+        v.entries[1] = vertices[i + 1];
+        v.entries[2] = vertices[i + 2];
+        vertex_positions.push_back(v);
+        mass.push_back(0.1f);
+    }
+    vertex_positions_invalid = false;
+    compute_row_length();
+
+    assert(faces.size() % 3 == 0);
+    triangles.reserve(faces.size() / 3);
+    for (size_t i = 0; i < faces.size(); i += 3)
+    {
+        uint3 t;
+        t.data[0] = faces[i];
+        t.data[1] = faces[i + 1];
+        t.data[2] = faces[i + 2];
+        triangles.push_back(t);
+    }
+
+    // construct list of edges
+    //  https://stackoverflow.com/questions/17016175/c-unordered-map-using-a-custom-class-type-as-the-key
+    struct KeyHasher
+    {
+        std::size_t operator()(const RealVector<unsigned int, 2> &k) const
+        {
+            return ((std::hash<unsigned int>()(k.data[0]) ^ (std::hash<unsigned int>()(k.data[1]) << 1)) >> 1);
+        }
+    };
+    std::unordered_set<RealVector<unsigned int, 2>, KeyHasher> temp_unique_edges;
+    for (const uint3 &triangle : triangles)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            unsigned int v1 = triangle.data[i];
+            unsigned int v2 = triangle.data[(i + 1) % 3];
+            RealVector<unsigned int, 2> edge_index;
+            edge_index.data[0] = v1;
+            edge_index.data[1] = v2;
+            if (temp_unique_edges.contains(edge_index))
+                continue;
+
+            temp_unique_edges.insert(edge_index);
+        }
+    }
+
+    int num_vertices_per_row = row_length;
+    for (const auto &a : temp_unique_edges)
+    {
+
+        auto v1 = a.data[0];
+        auto v2 = a.data[1];
+
+        auto index_dist = std::abs((int)(v1 - v2));
+
+        if (index_dist == 1 || index_dist == num_vertices_per_row)
+        {
+            unique_springs.push_back(a);
+            vec3 x1 = vertex_positions[v1];
+            vec3 x2 = vertex_positions[v2];
+            vec3 delta_x1 = x2 - x1;
+            float length_v = length(delta_x1);
+            rest_distance.push_back(length_v);
+        }
+        else
+        {
+            continue;
+        }
+    }
+
+    // The springs are found from the file order, which knows the rows of grid meshes.
+    reorder_vertices(ordering);
+
+    // Pin sets are stored next to the mesh, e.g. cloth_50.pins for cloth_50.obj.
+    std::filesystem::path pin_path(cloth_path);
+    pin_path.replace_extension(".pins");
+    if (std::filesystem::exists(pin_path))
+        load_pinned_vertices(pin_path.string());
+
+    color_springs();
+    compute_vertex_springs();
+    compute_vertex_neighbors();
+    back_vertex_positions = vertex_positions;
+}
+
+/**
+ * @brief Bring the vertices into the given order and renumber the triangles and springs.
+ * Afterwards, the springs are sorted by their vertices, so the spring loops walk
+ * through the vertices almost sequentially instead of in the order of a hash set.
+ *
+ * @param ordering The new order of the vertices.
+ */
+void ClothState::reorder_vertices(VertexOrdering ordering)
+{
+    size_t size = vertex_positions.size();
+    // The vertices of the file in their new order.
+    std::vector<unsigned int> order(size);
+    for (size_t i = 0; i < size; i++)
+        order[i] = i;
+
+    if (ordering == VertexOrdering::MORTON_ORDER && size > 0)
+    {
+        vec3 lower = vertex_positions[0];
+        vec3 upper = vertex_positions[0];
+        for (const vec3 &v : vertex_positions)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                lower.entries[axis] = std::min(lower.entries[axis], v.entries[axis]);
+                upper.entries[axis] = std::max(upper.entries[axis], v.entries[axis]);
+            }
+        }
+
+        // Quantize the axes to 21 bits and interleave them. All axes share the scale
+        // of the largest extent, so the noise of a flat cloth only orders neighbors.
+        float extent = std::max({upper.entries[0] - lower.entries[0], upper.entries[1] - lower.entries[1],
+                                 upper.entries[2] - lower.entries[2]});
+        float scale = extent > 0.0f ? ((1 << 21) - 1) / extent : 0.0f;
+        std::vector<uint64_t> keys(size);
+        for (size_t i = 0; i < size; i++)
+        {
+            uint64_t key = 0;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                uint64_t cell = static_cast<uint64_t>((vertex_positions[i].entries[axis] - lower.entries[axis]) * scale);
+                for (int bit = 0; bit < 21; bit++)
+                    key |= ((cell >> bit) & 1) << (3 * bit + axis);
+            }
+            keys[i] = key;
+        }
+        std::sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b)
+                  { return keys[a] < keys[b] || (keys[a] == keys[b] && a < b); });
+    }
+
+    vertex_indices.resize(size);
+    for (size_t i = 0; i < size; i++)
+        vertex_indices[order[i]] = i;
+
+    std::vector<vec3> file_positions(std::move(vertex_positions));
+    std::vector<float> file_mass(std::move(mass));
+    vertex_positions.resize(size);
+    mass.resize(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        vertex_positions[i] = file_positions[order[i]];
+        mass[i] = file_mass[order[i]];
+    }
+
+    for (uint3 &triangle : triangles)
+    {
+        for (int i = 0; i < 3; i++)
+            triangle.data[i] = vertex_indices[triangle.data[i]];
+    }
+
+    // Renumber the springs and sort them by their first, then their second vertex. The edge
+    // set holds both directions of the edges inside the mesh, these two springs stay apart.
+    std::vector<unsigned int> spring_order(unique_springs.size());
+    for (size_t i = 0; i < unique_springs.size(); i++)
+    {
+        unique_springs[i].data[0] = vertex_indices[unique_springs[i].data[0]];
+        unique_springs[i].data[1] = vertex_indices[unique_springs[i].data[1]];
+        spring_order[i] = i;
+    }
+    std::sort(spring_order.begin(), spring_order.end(), [&](unsigned int a, unsigned int b)
+              { return unique_springs[a].data[0] < unique_springs[b].data[0] ||
+                       (unique_springs[a].data[0] == unique_springs[b].data[0] && unique_springs[a].data[1] < unique_springs[b].data[1]); });
+
+    huge_page_vector<RealVector<unsigned int, 2>> file_springs(std::move(unique_springs));
+    huge_page_vector<float> file_rest_distance(std::move(rest_distance));
+    unique_springs.resize(file_springs.size());
+    rest_distance.resize(file_springs.size());
+    for (size_t i = 0; i < spring_order.size(); i++)
+    {
+        unique_springs[i] = file_springs[spring_order[i]];
+        rest_distance[i] = file_rest_distance[spring_order[i]];
+    }
+}
+
+/**
+ * @brief Count the vertices of the first row, assuming the vertices of a grid
+ * mesh are stored row by row. All vertices of a row share the same height.
+ */
+void ClothState::compute_row_length()
+{
+    row_length = 1;
+    while (row_length < vertex_positions.size() &&
+           vertex_positions[row_length].entries[1] == vertex_positions[0].entries[1])
+    {
+        row_length++;
+    }
+}
+
+/**
+ * @brief Greedily assign a color to every spring, such that no two springs
+ * of the same color share a vertex. Springs of one color can then be solved in parallel.
+ * The springs are reordered, such that each color is a contiguous range.
+ */
+void ClothState::color_springs()
+{
+    // Bit c of a vertex mask is set if a spring of color c uses the vertex.
+    std::vector<uint64_t> used_colors(vertex_positions.size(), 0);
+    // Colors from 64 on used by a vertex, only needed for vertices with more than 64 springs.
+    std::vector<std::vector<unsigned int>> used_high_colors(vertex_positions.size());
+    spring_colors.clear();
+
+    for (size_t i = 0; i < unique_springs.size(); i++)
+    {
+        unsigned int v1 = unique_springs[i].data[0];
+        unsigned int v2 = unique_springs[i].data[1];
+
+        uint64_t used = used_colors[v1] | used_colors[v2];
+        unsigned int color = std::countr_one(used);
+        if (color == 64)
+        {
+            auto is_used = [&](unsigned int v)
+            {
+                return std::find(used_high_colors[v].begin(), used_high_colors[v].end(), color) != used_high_colors[v].end();
+            };
+            while (is_used(v1) || is_used(v2))
+                color++;
+        }
+
+        if (color >= spring_colors.size())
+            spring_colors.resize(color + 1);
+        spring_colors[color].push_back(i);
+        if (color < 64)
+        {
+            used_colors[v1] |= uint64_t(1) << color;
+            used_colors[v2] |= uint64_t(1) << color;
+        }
+        else
+        {
+            used_high_colors[v1].push_back(color);
+            used_high_colors[v2].push_back(color);
+        }
+    }
+
+    // Store the springs color by color. Consecutive springs then share no vertex, so the
+    // serial solver does not wait for the previous correction, and the springs of a color
+    // keep their order by vertex.
+    huge_page_vector<RealVector<unsigned int, 2>> uncolored_springs(std::move(unique_springs));
+    huge_page_vector<float> uncolored_rest_distance(std::move(rest_distance));
+    unique_springs.clear();
+    rest_distance.clear();
+    for (std::vector<unsigned int> &color : spring_colors)
+    {
+        for (unsigned int &spring : color)
+        {
+            unique_springs.push_back(uncolored_springs[spring]);
+            rest_distance.push_back(uncolored_rest_distance[spring]);
+            spring = unique_springs.size() - 1;
+        }
+    }
+}
+
+/**
+ * @brief Build the list of attached springs for every vertex.
+ * Allows computations per vertex that need all of its springs.
+ */
+void ClothState::compute_vertex_springs()
+{
+    // Count the springs per vertex and turn the counts into offsets.
+    vertex_spring_offsets.assign(vertex_positions.size() + 1, 0);
+    for (const auto &spring : unique_springs)
+    {
+        vertex_spring_offsets[spring.data[0] + 1]++;
+        vertex_spring_offsets[spring.data[1] + 1]++;
+    }
+    for (size_t i = 1; i < vertex_spring_offsets.size(); i++)
+    {
+        vertex_spring_offsets[i] += vertex_spring_offsets[i - 1];
+    }
+
+    // Fill in the springs, using a running insert position per vertex.
+    std::vector<unsigned int> insert_position(vertex_spring_offsets.begin(), vertex_spring_offsets.end() - 1);
+    vertex_springs.resize(2 * unique_springs.size());
+    for (size_t i = 0; i < unique_springs.size(); i++)
+    {
+        vertex_springs[insert_position[unique_springs[i].data[0]]++] = i;
+        vertex_springs[insert_position[unique_springs[i].data[1]]++] = i;
+    }
+}
+
+/**
+ * @brief Build the list of vertices sharing a triangle edge with every vertex.
+ * Unlike the springs, this includes the diagonals of the grid meshes.
+ */
+void ClothState::compute_vertex_neighbors()
+{
+    // Every triangle edge is listed for both of its vertices, edges shared
+    // by two triangles twice. The duplicates are removed after sorting.
+    std::vector<unsigned int> counts(vertex_positions.size() + 1, 0);
+    for (const uint3 &triangle : triangles)
+    {
+        for (int i = 0; i < 3; i++)
+            counts[triangle.data[i] + 1] += 2;
+    }
+    for (size_t i = 1; i < counts.size(); i++)
+        counts[i] += counts[i - 1];
+
+    std::vector<unsigned int> insert_position(counts.begin(), counts.end() - 1);
+    std::vector<unsigned int> candidates(counts.back());
+    for (const uint3 &triangle : triangles)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            unsigned int v = triangle.data[i];
+            candidates[insert_position[v]++] = triangle.data[(i + 1) % 3];
+            candidates[insert_position[v]++] = triangle.data[(i + 2) % 3];
+        }
+    }
+
+    vertex_neighbor_offsets.assign(vertex_positions.size() + 1, 0);
+    vertex_neighbors.clear();
+    vertex_neighbors.reserve(candidates.size() / 2);
+    for (size_t v = 0; v < vertex_positions.size(); v++)
+    {
+        auto begin = candidates.begin() + counts[v];
+        auto end = candidates.begin() + counts[v + 1];
+        std::sort(begin, end);
+        vertex_neighbors.insert(vertex_neighbors.end(), begin, std::unique(begin, end));
+        vertex_neighbor_offsets[v + 1] = vertex_neighbors.size();
+    }
+}
+
+/**
+ * @returns A pointer to the mass vector.
+ *
+ * @brief Gets the vector containing particle masses.
+ * Each mass is mapped to a particle / vertex by its index.
+ */
+const std::vector<float> &ClothState::get_mass_ref() const
+{
+    return mass;
+}
+
+/**
+ * @param file_index The index of a vertex in the obj file.
+ * @returns The index of the vertex in the vertex positions.
+ *
+ * @brief Translates vertex indices of the obj file into the order of the cloth.
+ * Needed to address vertices by their place in the grid, like the mounts.
+ */
+unsigned int ClothState::get_vertex_index(unsigned int file_index) const
+{
+    assert(file_index < vertex_indices.size());
+    return vertex_indices[file_index];
+}
+
+/**
+ * @returns The number of vertices in the first row of the mesh.
+ *
+ * @brief Gets the row length of a grid mesh.
+ * Allows mounting non-square grids.
+ */
+unsigned int ClothState::get_row_length() const
+{
+    return row_length;
+}
+
+/**
+ * @param pin_path Path to the pin file.
+ * @returns If the file could be read.
+ *
+ * @brief Reads the pin set from a file. The file lists 1-based vertex indices,
+ * like the faces of an obj file, separated by whitespace. Lines starting with
+ * # are comments. Indices outside of the mesh are skipped.
+ */
+bool ClothState::load_pinned_vertices(const std::string &pin_path)
+{
+    std::ifstream file(pin_path);
+    if (!file.is_open())
+    {
+        std::cout << "Unable to open pin file." << std::endl;
+        return false;
+    }
+
+    pinned_vertices.clear();
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (!line.empty() && line.front() == '#')
+            continue;
+
+        std::stringstream line_stream(line);
+        unsigned int index;
+        while (line_stream >> index)
+        {
+            if (index == 0 || index > vertex_positions.size())
+            {
+                std::cout << "Skipping pinned vertex " << index << " outside of the mesh." << std::endl;
+                continue;
+            }
+            pinned_vertices.push_back(vertex_indices[index - 1]);
+        }
+    }
+    return true;
+}
+
+/**
+ * @param new_pinned_vertices 0-based indices of the vertices to pin, in the order of the obj file.
+ *
+ * @brief Replaces the pin set, e.g. with a vertex group of the mesh.
+ * Only affects physics engines created afterwards.
+ */
+void ClothState::set_pinned_vertices(const std::vector<unsigned int> &new_pinned_vertices)
+{
+    assert(std::all_of(new_pinned_vertices.begin(), new_pinned_vertices.end(),
+                       [this](unsigned int index)
+                       { return index < vertex_positions.size(); }));
+    pinned_vertices.clear();
+    for (unsigned int index : new_pinned_vertices)
+        pinned_vertices.push_back(vertex_indices[index]);
+}
+
+/**
+ * @returns The indices of the pinned vertices in the vertex positions.
+ *
+ * @brief Gets the pin set of the cloth.
+ */
+const std::vector<unsigned int> &ClothState::get_pinned_vertices_ref() const
+{
+    return pinned_vertices;
+}
+
+/**
+ * @returns A pointer to the rest distance vector.
+ *
+ * @brief Gets the vector containing spring rest distances.
+ * Each mass is mapped to a spring by its index.
+ */
+const huge_page_vector<float> &ClothState::get_rest_distance_ref() const
+{
+    return rest_distance;
+}
+
+/**
+ * @brief Helper function to get the vertex positions without copying them
+ *
+ * @return std::span<const float3> View of the front buffer, valid until the buffers are swapped
+ */
+std::span<const vec3> ClothState::get_vertex_positions() const
+{
+    return vertex_positions;
+}
+
+/**
+ * @brief Gets the buffer the next vertex positions are written to.
+ * They are shown after swap_vertex_positions().
+ *
+ * @return std::span<float3> View of the back buffer, valid until the buffers are swapped
+ */
+std::span<vec3> ClothState::get_back_vertex_positions()
+{
+    return back_vertex_positions;
+}
+
+/**
+ * @brief Show the positions written to the back buffer. The vectors only exchange
+ * their storage, so no position is copied.
+ */
+void ClothState::swap_vertex_positions()
+{
+    vertex_positions_invalid = true;
+    vertex_positions.swap(back_vertex_positions);
+}
+
+/**
+ * @brief Helper function to get the triangles
+ *
+ * @return std::vector<uint3>
+ */
+std::vector<uint3> ClothState::get_triangles() const
+{
+    return triangles;
+}
+
+/**
+ * @brief Helper function to get the vertex positions
+ *
+ * @return const std::vector<float3>&
+ */
+const std::vector<uint3> &ClothState::get_triangles_ref() const
+{
+    return triangles;
+}
+
+/**
+ * @returns A pointer to the spring vector.
+ *
+ * @brief Gets the vector containing springs.
+ * Each spring is unique.
+ */
+const huge_page_vector<RealVector<unsigned int, 2>> &ClothState::get_unique_springs_ref() const
+{
+    return unique_springs;
+}
+
+/**
+ * @returns The spring indices grouped by color.
+ *
+ * @brief Gets the spring coloring.
+ * No two springs of the same color share a vertex.
+ */
+const std::vector<std::vector<unsigned int>> &ClothState::get_spring_colors_ref() const
+{
+    return spring_colors;
+}
+
+/**
+ * @returns The offsets into the vertex spring vector.
+ *
+ * @brief Gets the offsets of the springs attached to each vertex.
+ * Holds one more entry than there are vertices.
+ */
+const std::vector<unsigned int> &ClothState::get_vertex_spring_offsets_ref() const
+{
+    return vertex_spring_offsets;
+}
+
+/**
+ * @returns The spring indices, grouped by vertex.
+ *
+ * @brief Gets the springs attached to each vertex.
+ * Use the vertex spring offsets to find the springs of a vertex.
+ */
+const std::vector<unsigned int> &ClothState::get_vertex_springs_ref() const
+{
+    return vertex_springs;
+}
+
+/**
+ * @returns The offsets of each vertex into the vertex neighbors.
+ *
+ * @brief The neighbors of vertex i are at [offsets[i], offsets[i + 1]).
+ */
+const std::vector<unsigned int> &ClothState::get_vertex_neighbor_offsets_ref() const
+{
+    return vertex_neighbor_offsets;
+}
+
+/**
+ * @returns The vertices sharing a triangle edge, grouped by vertex.
+ *
+ * @brief Gets the neighbors of each vertex in the triangle mesh.
+ */
+const std::vector<unsigned int> &ClothState::get_vertex_neighbors_ref() const
+{
+    return vertex_neighbors;
+}
+
+/**
+ * @brief Set the vertex positions
+ * Physics engines keep simulating their own positions, set them before creating one.
+ *
+ * @param new_vertex_positions
+ */
+void ClothState::set_vertex_positions(std::span<const vec3> new_vertex_positions)
+{
+    if (new_vertex_positions.size() != vertex_positions.size())
+    {
+        std::cout << "error!" << std::endl;
+        std::exit(1);
+    }
+
+    vertex_positions_invalid = true;
+    std::copy(new_vertex_positions.begin(), new_vertex_positions.end(), vertex_positions.begin());
+}
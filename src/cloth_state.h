@@ -0,0 +1,114 @@
+#pragma once
+#include <span>
+#include <string>
+#include <vector>
+#include "algebraic_types.h"
+#include "huge_page_allocator.h"
+#include "linear_algebra.h"
+#include "obj_reader.h"
+
+// Determines the order of the vertices in memory.
+enum VertexOrdering
+{
+    // The order of the obj file. Grid meshes are stored row by row, which
+    // already keeps the neighbors of a vertex close to it in memory.
+    FILE_ORDER,
+    // Sorted along a Morton curve through the rest positions, so vertices close
+    // to each other in the cloth are mostly close to each other in memory,
+    // whatever order the obj file has.
+    MORTON_ORDER
+};
+
+/**
+ * Holds everything the physics engine needs to know about a cloth:
+ * its vertex positions, topology, springs, rest distances and masses.
+ * This class does not depend on OpenGL, so it can be simulated on machines
+ * without a graphics context.
+ * @brief Simulation state of a cloth.
+ */
+class ClothState
+{
+public:
+    ClothState(const std::string &cloth_path, VertexOrdering ordering = VertexOrdering::FILE_ORDER);
+
+protected:
+    // Set whenever the vertex positions changed and
+    // any derived data (e.g. GPU buffers) has to be refreshed.
+    mutable bool vertex_positions_invalid = true;
+    // The positions shown to the user. The physics engine writes the next positions
+    // into the back buffer in place and swaps the buffers afterwards, which only swaps
+    // the pointers of the vectors.
+    std::vector<vec3> vertex_positions;
+    std::vector<vec3> back_vertex_positions;
+    std::vector<uint3> triangles;
+
+    // Subset of unique edges, containing only straight edges
+    // meaning that diagonal edges have been removed
+    huge_page_vector<RealVector<unsigned int, 2>> unique_springs;
+
+    // The rest distance between two nodes
+    // computed as the average edge length
+    huge_page_vector<float> rest_distance;
+
+    // The mass of the particles.
+    std::vector<float> mass;
+
+    // Index of every vertex of the obj file in vertex_positions, after reordering.
+    std::vector<unsigned int> vertex_indices;
+
+    // Vertices held in place by the pin set mount. Loaded from a
+    // sidecar file next to the obj file, if there is one.
+    std::vector<unsigned int> pinned_vertices;
+
+    // Number of vertices in the first row of a grid mesh.
+    // For meshes which are no grid this is usually 1.
+    unsigned int row_length;
+
+    // Spring indices grouped by color. No two springs
+    // of the same color share a vertex.
+    std::vector<std::vector<unsigned int>> spring_colors;
+
+    // Springs attached to each vertex in compressed row format. The springs of
+    // vertex i are vertex_springs[vertex_spring_offsets[i]] up to
+    // vertex_springs[vertex_spring_offsets[i + 1]] (exclusive).
+    std::vector<unsigned int> vertex_spring_offsets;
+    std::vector<unsigned int> vertex_springs;
+
+    // Vertices sharing a triangle edge with each vertex, including the diagonals
+    // without a spring, in compressed row format like the springs. Sorted per vertex.
+    std::vector<unsigned int> vertex_neighbor_offsets;
+    std::vector<unsigned int> vertex_neighbors;
+
+    void compute_row_length();
+    void reorder_vertices(VertexOrdering ordering);
+    void color_springs();
+    void compute_vertex_springs();
+    void compute_vertex_neighbors();
+
+public:
+    const huge_page_vector<float> &get_rest_distance_ref() const;
+    const std::vector<float> &get_mass_ref() const;
+    unsigned int get_row_length() const;
+    unsigned int get_vertex_index(unsigned int file_index) const;
+
+    bool load_pinned_vertices(const std::string &pin_path);
+    void set_pinned_vertices(const std::vector<unsigned int> &new_pinned_vertices);
+    const std::vector<unsigned int> &get_pinned_vertices_ref() const;
+
+    // Views of the vertex positions, valid until the next swap.
+    std::span<const vec3> get_vertex_positions() const;
+    std::span<vec3> get_back_vertex_positions();
+    // these will invalidate the vertex positions array
+    void swap_vertex_positions();
+    void set_vertex_positions(std::span<const vec3> new_vertex_positions);
+
+    // topology remains unchanged, so we dont need a setter!
+    std::vector<uint3> get_triangles() const;
+    const std::vector<uint3> &get_triangles_ref() const;
+    const huge_page_vector<RealVector<unsigned int, 2>> &get_unique_springs_ref() const;
+    const std::vector<std::vector<unsigned int>> &get_spring_colors_ref() const;
+    const std::vector<unsigned int> &get_vertex_spring_offsets_ref() const;
+    const std::vector<unsigned int> &get_vertex_springs_ref() const;
+    const std::vector<unsigned int> &get_vertex_neighbor_offsets_ref() const;
+    const std::vector<unsigned int> &get_vertex_neighbors_ref() const;
+};
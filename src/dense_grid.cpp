@@ -0,0 +1,189 @@
+#include "dense_grid.h"
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "thread_pool.h"
+
+/**
+ * @brief Construct a new empty Dense Grid:: Dense Grid object
+ * Call update() to fill it with particles.
+ *
+ * @param _spacing The smallest edge length of the cells
+ * @param _cells_per_particle Upper limit of the cells per particle
+ */
+DenseGrid::DenseGrid(float _spacing, unsigned int _cells_per_particle)
+{
+	assert(_spacing > 0.0f && _cells_per_particle > 0);
+	min_spacing = _spacing;
+	spacing = _spacing;
+	cells_per_particle = _cells_per_particle;
+	origin = {0.0f, 0.0f, 0.0f};
+	dimensions = {1, 1, 1};
+	cell_starts.assign(2, 0);
+}
+
+/**
+ * @brief Fit the grid to the bounding box of the particles and sort them into its cells.
+ * Reuses the buffers of the previous update.
+ *
+ * @param vertices The particles to be discretized
+ * @param thread_pool The threads to compute the cells with
+ */
+void DenseGrid::update(const ParticleStore &vertices, ThreadPool &thread_pool)
+{
+	size_t size = vertices.size();
+	float lower[3] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+	float upper[3] = {std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()};
+	for (size_t i = 0; i < size; i++)
+	{
+		lower[0] = std::min(lower[0], vertices.x[i]);
+		lower[1] = std::min(lower[1], vertices.y[i]);
+		lower[2] = std::min(lower[2], vertices.z[i]);
+		upper[0] = std::max(upper[0], vertices.x[i]);
+		upper[1] = std::max(upper[1], vertices.y[i]);
+		upper[2] = std::max(upper[2], vertices.z[i]);
+	}
+	if (size == 0)
+	{
+		lower[0] = lower[1] = lower[2] = 0.0f;
+		upper[0] = upper[1] = upper[2] = 0.0f;
+	}
+
+	// Grow the cells until the grid fits into the memory limit.
+	size_t max_cells = std::max<size_t>(size_t(cells_per_particle) * size, 4096);
+	spacing = min_spacing;
+	size_t cell_count;
+	while (true)
+	{
+		double cells = 1.0;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			dimensions.data[axis] = static_cast<int>(std::min((upper[axis] - lower[axis]) / spacing, 1e9f)) + 1;
+			cells *= dimensions.data[axis];
+		}
+		cell_count = static_cast<size_t>(cells);
+		if (cells <= max_cells)
+			break;
+		spacing *= std::max(1.01f, static_cast<float>(std::cbrt(cells / max_cells)));
+	}
+	origin = {lower[0], lower[1], lower[2]};
+
+	// Only allocates when the particle count or the grid grew.
+	particles.resize(size);
+	particle_cells.resize(size);
+	cell_coordinates.resize(size);
+	cell_starts.assign(cell_count + 1, 0);
+
+	thread_pool.parallel_for(0, size, [&](size_t begin, size_t end)
+							 {
+		for (size_t i = begin; i < end; i++)
+			particle_cells[i] = linear_index(compute_cell(vertices.x[i], vertices.y[i], vertices.z[i])); }, 4096);
+
+	// Counting sort, like the spatial hash.
+	for (size_t i = 0; i < size; i++)
+		cell_starts[particle_cells[i]]++;
+
+	unsigned int sum = 0;
+	for (size_t c = 0; c < cell_starts.size(); c++)
+	{
+		sum += cell_starts[c];
+		cell_starts[c] = sum;
+	}
+
+	// Scatter backwards, so the particles of a cell are in ascending order.
+	for (size_t i = size; i-- > 0;)
+	{
+		unsigned int index = --cell_starts[particle_cells[i]];
+		particles[index] = i;
+		cell_coordinates[index] = compute_cell(vertices.x[i], vertices.y[i], vertices.z[i]);
+	}
+}
+
+/**
+ * @brief Collect the pairs within the cutoff. Compares each particle with the later
+ * particles of its own cell and with the particles of its 13 forward neighbor cells.
+ *
+ * @param vertices The particles the grid was updated with
+ * @param cutoff The largest distance of a pair, at most the spacing
+ * @param pairs The pairs are appended to this list
+ */
+void DenseGrid::collect_pairs(const ParticleStore &vertices, float cutoff,
+							  std::vector<RealVector<unsigned int, 2>> &pairs) const
+{
+	assert(cutoff <= spacing);
+	const float *x = vertices.x.data();
+	const float *y = vertices.y.data();
+	const float *z = vertices.z.data();
+	float cutoff_squared = cutoff * cutoff;
+
+	auto test_pair = [&](unsigned int i, unsigned int j)
+	{
+		float delta_x = x[i] - x[j];
+		float delta_y = y[i] - y[j];
+		float delta_z = z[i] - z[j];
+		if (delta_x * delta_x + delta_y * delta_y + delta_z * delta_z <= cutoff_squared)
+			pairs.push_back({i, j});
+	};
+
+	for (unsigned int s = 0; s < particles.size(); s++)
+	{
+		unsigned int i = particles[s];
+		const int3 &cell = cell_coordinates[s];
+		for (unsigned int t = s + 1; t < cell_starts[particle_cells[i] + 1]; t++)
+			test_pair(i, particles[t]);
+
+		for (const int3 &offset : forward_offsets)
+		{
+			int3 neighbor = cell + offset;
+			if (neighbor.data[0] >= dimensions.data[0] || neighbor.data[1] < 0 || neighbor.data[1] >= dimensions.data[1] ||
+				neighbor.data[2] < 0 || neighbor.data[2] >= dimensions.data[2])
+				continue;
+			unsigned int c = linear_index(neighbor);
+			for (unsigned int t = cell_starts[c]; t < cell_starts[c + 1]; t++)
+				test_pair(i, particles[t]);
+		}
+	}
+}
+
+/**
+ * @returns The edge length of the cells of the last update.
+ */
+float DenseGrid::get_spacing() const
+{
+	return spacing;
+}
+
+/**
+ * @returns The number of cells of the last update.
+ */
+size_t DenseGrid::get_cell_count() const
+{
+	return cell_starts.size() - 1;
+}
+
+/**
+ * @brief Compute the grid cell of a vertex, clamped to the grid
+ *
+ * @param x The x coordinate of the vertex
+ * @param y The y coordinate of the vertex
+ * @param z The z coordinate of the vertex
+ * @return int3 The cell coordinates
+ */
+int3 DenseGrid::compute_cell(float x, float y, float z) const
+{
+	return {std::clamp(static_cast<int>((x - origin.entries[0]) / spacing), 0, dimensions.data[0] - 1),
+			std::clamp(static_cast<int>((y - origin.entries[1]) / spacing), 0, dimensions.data[1] - 1),
+			std::clamp(static_cast<int>((z - origin.entries[2]) / spacing), 0, dimensions.data[2] - 1)};
+}
+
+/**
+ * @brief Number a cell of the grid, x is the slowest axis
+ *
+ * @param cell The cell coordinates, inside the grid
+ * @return unsigned int The index of the cell
+ */
+unsigned int DenseGrid::linear_index(int3 cell) const
+{
+	return (cell.data[0] * dimensions.data[1] + cell.data[1]) * dimensions.data[2] + cell.data[2];
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <vector>
+#include "algebraic_types.h"
+#include "broad_phase.h"
+#include "linear_algebra.h"
+#include "particle_store.h"
+
+/**
+ * The grid is fitted to the bounding box of the particles in every update and stores
+ * the offsets of every cell, empty or not. Unlike the spatial hash, no two cells share
+ * an entry, so no particles of other cells have to be skipped. If the bounding box
+ * would need too many cells, the cells are grown until they fit.
+ * @brief Dense uniform grid of the particles for neighbor queries.
+ */
+class DenseGrid : public BroadPhase
+{
+public:
+	DenseGrid(float spacing = 1.0f, unsigned int cells_per_particle = 64);
+
+	void update(const ParticleStore &particles, ThreadPool &thread_pool) override;
+	void collect_pairs(const ParticleStore &particles, float cutoff,
+					   std::vector<RealVector<unsigned int, 2>> &pairs) const override;
+
+	float get_spacing() const;
+	size_t get_cell_count() const;
+
+private:
+	// Smallest edge length of the cells, and the one of the last update.
+	float min_spacing;
+	float spacing;
+	// Upper limit of the cells per particle, keeps the memory bounded when the cloth spreads out.
+	unsigned int cells_per_particle;
+
+	// Lower corner and number of cells of the grid along every axis.
+	vec3 origin;
+	int3 dimensions;
+
+	// The particles of cell c are particles[cell_starts[c]] up to particles[cell_starts[c + 1]]
+	// (exclusive). Cells are numbered with x as the slowest and z as the fastest axis.
+	std::vector<unsigned int> cell_starts;
+	std::vector<unsigned int> particles;
+	// Cell of every particle, and of every entry of the particles array.
+	std::vector<unsigned int> particle_cells;
+	std::vector<int3> cell_coordinates;
+
+	int3 compute_cell(float x, float y, float z) const;
+	unsigned int linear_index(int3 cell) const;
+};
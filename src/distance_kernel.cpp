@@ -0,0 +1,369 @@
+#include "distance_kernel.h"
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DISTANCE_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Solve the springs [first, batch.count) one at a time.
+ * Used for machines without vector units and for the remainder of the vectorized kernels.
+ */
+static void solve_scalar(float *x, float *y, float *z, const DistanceConstraintBatch &batch, size_t first)
+{
+    for (size_t i = first; i < batch.count; i++)
+    {
+        unsigned int v1 = batch.v1[i];
+        unsigned int v2 = batch.v2[i];
+
+        float delta_x = x[v2] - x[v1];
+        float delta_y = y[v2] - y[v1];
+        float delta_z = z[v2] - z[v1];
+        float length_v = std::sqrt(delta_x * delta_x + delta_y * delta_y + delta_z * delta_z);
+        float offset = (length_v - batch.rest_distance[i]) / length_v;
+
+        x[v1] += delta_x * offset * batch.share1[i];
+        y[v1] += delta_y * offset * batch.share1[i];
+        z[v1] += delta_z * offset * batch.share1[i];
+        x[v2] -= delta_x * offset * batch.share2[i];
+        y[v2] -= delta_y * offset * batch.share2[i];
+        z[v2] -= delta_z * offset * batch.share2[i];
+    }
+}
+
+static void distance_kernel_scalar(float *x, float *y, float *z, const DistanceConstraintBatch &batch)
+{
+    solve_scalar(x, y, z, batch, 0);
+}
+
+/**
+ * @brief Test the candidates [first, count) one at a time, appending the hits after hit_count.
+ * Used for machines without vector units and for the remainder of the vectorized kernels.
+ * The squared distance is summed in the same order by all kernels, so they find the same pairs.
+ */
+static size_t find_close_scalar(float x, float y, float z, const float *candidate_x, const float *candidate_y, const float *candidate_z,
+                                size_t first, size_t count, float cutoff_squared, unsigned int *hits, size_t hit_count)
+{
+    for (size_t c = first; c < count; c++)
+    {
+        float delta_x = x - candidate_x[c];
+        float delta_y = y - candidate_y[c];
+        float delta_z = z - candidate_z[c];
+        if (delta_x * delta_x + delta_y * delta_y + delta_z * delta_z <= cutoff_squared)
+            hits[hit_count++] = c;
+    }
+    return hit_count;
+}
+
+static size_t proximity_kernel_scalar(float x, float y, float z, const float *candidate_x, const float *candidate_y,
+                                      const float *candidate_z, size_t count, float cutoff_squared, unsigned int *hits)
+{
+    return find_close_scalar(x, y, z, candidate_x, candidate_y, candidate_z, 0, count, cutoff_squared, hits, 0);
+}
+
+#ifdef DISTANCE_KERNEL_X86
+/**
+ * @brief Four springs per instruction. SSE has no gather, so the
+ * positions are loaded and stored lane by lane.
+ */
+__attribute__((target("sse2"))) static void distance_kernel_sse(float *x, float *y, float *z, const DistanceConstraintBatch &batch)
+{
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three_halves = _mm_set1_ps(1.5f);
+    alignas(16) float out[6][4];
+
+    size_t i = 0;
+    for (; i + 4 <= batch.count; i += 4)
+    {
+        const unsigned int *v1 = batch.v1 + i;
+        const unsigned int *v2 = batch.v2 + i;
+        __m128 x1 = _mm_setr_ps(x[v1[0]], x[v1[1]], x[v1[2]], x[v1[3]]);
+        __m128 y1 = _mm_setr_ps(y[v1[0]], y[v1[1]], y[v1[2]], y[v1[3]]);
+        __m128 z1 = _mm_setr_ps(z[v1[0]], z[v1[1]], z[v1[2]], z[v1[3]]);
+        __m128 x2 = _mm_setr_ps(x[v2[0]], x[v2[1]], x[v2[2]], x[v2[3]]);
+        __m128 y2 = _mm_setr_ps(y[v2[0]], y[v2[1]], y[v2[2]], y[v2[3]]);
+        __m128 z2 = _mm_setr_ps(z[v2[0]], z[v2[1]], z[v2[2]], z[v2[3]]);
+
+        __m128 delta_x = _mm_sub_ps(x2, x1);
+        __m128 delta_y = _mm_sub_ps(y2, y1);
+        __m128 delta_z = _mm_sub_ps(z2, z1);
+        __m128 length_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(delta_x, delta_x), _mm_mul_ps(delta_y, delta_y)), _mm_mul_ps(delta_z, delta_z));
+
+        // Approximate 1 / length and refine it with one Newton step.
+        __m128 inverse_length = _mm_rsqrt_ps(length_squared);
+        inverse_length = _mm_mul_ps(inverse_length, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, length_squared), _mm_mul_ps(inverse_length, inverse_length))));
+        __m128 length_v = _mm_mul_ps(length_squared, inverse_length);
+        __m128 offset = _mm_mul_ps(_mm_sub_ps(length_v, _mm_loadu_ps(batch.rest_distance + i)), inverse_length);
+
+        __m128 share1 = _mm_mul_ps(offset, _mm_loadu_ps(batch.share1 + i));
+        __m128 share2 = _mm_mul_ps(offset, _mm_loadu_ps(batch.share2 + i));
+        _mm_store_ps(out[0], _mm_add_ps(x1, _mm_mul_ps(delta_x, share1)));
+        _mm_store_ps(out[1], _mm_add_ps(y1, _mm_mul_ps(delta_y, share1)));
+        _mm_store_ps(out[2], _mm_add_ps(z1, _mm_mul_ps(delta_z, share1)));
+        _mm_store_ps(out[3], _mm_sub_ps(x2, _mm_mul_ps(delta_x, share2)));
+        _mm_store_ps(out[4], _mm_sub_ps(y2, _mm_mul_ps(delta_y, share2)));
+        _mm_store_ps(out[5], _mm_sub_ps(z2, _mm_mul_ps(delta_z, share2)));
+
+        for (int lane = 0; lane < 4; lane++)
+        {
+            x[v1[lane]] = out[0][lane];
+            y[v1[lane]] = out[1][lane];
+            z[v1[lane]] = out[2][lane];
+            x[v2[lane]] = out[3][lane];
+            y[v2[lane]] = out[4][lane];
+            z[v2[lane]] = out[5][lane];
+        }
+    }
+
+    solve_scalar(x, y, z, batch, i);
+}
+
+/**
+ * @brief Eight springs per instruction. Positions are gathered,
+ * AVX2 has no scatter, so they are stored lane by lane.
+ */
+__attribute__((target("avx2,fma"))) static void distance_kernel_avx2(float *x, float *y, float *z, const DistanceConstraintBatch &batch)
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    alignas(32) float out[6][8];
+
+    size_t i = 0;
+    for (; i + 8 <= batch.count; i += 8)
+    {
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(batch.v1 + i));
+        __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(batch.v2 + i));
+        __m256 x1 = _mm256_i32gather_ps(x, v1, 4);
+        __m256 y1 = _mm256_i32gather_ps(y, v1, 4);
+        __m256 z1 = _mm256_i32gather_ps(z, v1, 4);
+        __m256 x2 = _mm256_i32gather_ps(x, v2, 4);
+        __m256 y2 = _mm256_i32gather_ps(y, v2, 4);
+        __m256 z2 = _mm256_i32gather_ps(z, v2, 4);
+
+        __m256 delta_x = _mm256_sub_ps(x2, x1);
+        __m256 delta_y = _mm256_sub_ps(y2, y1);
+        __m256 delta_z = _mm256_sub_ps(z2, z1);
+        __m256 length_squared = _mm256_fmadd_ps(delta_z, delta_z, _mm256_fmadd_ps(delta_y, delta_y, _mm256_mul_ps(delta_x, delta_x)));
+
+        // Approximate 1 / length and refine it with one Newton step.
+        __m256 inverse_length = _mm256_rsqrt_ps(length_squared);
+        inverse_length = _mm256_mul_ps(inverse_length, _mm256_fnmadd_ps(_mm256_mul_ps(half, length_squared), _mm256_mul_ps(inverse_length, inverse_length), three_halves));
+        __m256 length_v = _mm256_mul_ps(length_squared, inverse_length);
+        __m256 offset = _mm256_mul_ps(_mm256_sub_ps(length_v, _mm256_loadu_ps(batch.rest_distance + i)), inverse_length);
+
+        __m256 share1 = _mm256_mul_ps(offset, _mm256_loadu_ps(batch.share1 + i));
+        __m256 share2 = _mm256_mul_ps(offset, _mm256_loadu_ps(batch.share2 + i));
+        _mm256_store_ps(out[0], _mm256_fmadd_ps(delta_x, share1, x1));
+        _mm256_store_ps(out[1], _mm256_fmadd_ps(delta_y, share1, y1));
+        _mm256_store_ps(out[2], _mm256_fmadd_ps(delta_z, share1, z1));
+        _mm256_store_ps(out[3], _mm256_fnmadd_ps(delta_x, share2, x2));
+        _mm256_store_ps(out[4], _mm256_fnmadd_ps(delta_y, share2, y2));
+        _mm256_store_ps(out[5], _mm256_fnmadd_ps(delta_z, share2, z2));
+
+        const unsigned int *index1 = batch.v1 + i;
+        const unsigned int *index2 = batch.v2 + i;
+        for (int lane = 0; lane < 8; lane++)
+        {
+            x[index1[lane]] = out[0][lane];
+            y[index1[lane]] = out[1][lane];
+            z[index1[lane]] = out[2][lane];
+            x[index2[lane]] = out[3][lane];
+            y[index2[lane]] = out[4][lane];
+            z[index2[lane]] = out[5][lane];
+        }
+    }
+
+    solve_scalar(x, y, z, batch, i);
+}
+
+/**
+ * @brief Four candidates per instruction, the hits are read off the comparison mask.
+ */
+__attribute__((target("sse2"))) static size_t proximity_kernel_sse(float x, float y, float z, const float *candidate_x, const float *candidate_y,
+                                                                   const float *candidate_z, size_t count, float cutoff_squared, unsigned int *hits)
+{
+    const __m128 point_x = _mm_set1_ps(x);
+    const __m128 point_y = _mm_set1_ps(y);
+    const __m128 point_z = _mm_set1_ps(z);
+    const __m128 cutoff = _mm_set1_ps(cutoff_squared);
+
+    size_t hit_count = 0;
+    size_t c = 0;
+    for (; c + 4 <= count; c += 4)
+    {
+        __m128 delta_x = _mm_sub_ps(point_x, _mm_loadu_ps(candidate_x + c));
+        __m128 delta_y = _mm_sub_ps(point_y, _mm_loadu_ps(candidate_y + c));
+        __m128 delta_z = _mm_sub_ps(point_z, _mm_loadu_ps(candidate_z + c));
+        __m128 length_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(delta_x, delta_x), _mm_mul_ps(delta_y, delta_y)), _mm_mul_ps(delta_z, delta_z));
+        for (unsigned int mask = _mm_movemask_ps(_mm_cmple_ps(length_squared, cutoff)); mask != 0; mask &= mask - 1)
+            hits[hit_count++] = c + __builtin_ctz(mask);
+    }
+
+    return find_close_scalar(x, y, z, candidate_x, candidate_y, candidate_z, c, count, cutoff_squared, hits, hit_count);
+}
+
+/**
+ * @brief Eight candidates per instruction. Without FMA, so the squared
+ * distances are rounded like the ones of the scalar kernel.
+ */
+__attribute__((target("avx2"))) static size_t proximity_kernel_avx2(float x, float y, float z, const float *candidate_x, const float *candidate_y,
+                                                                    const float *candidate_z, size_t count, float cutoff_squared, unsigned int *hits)
+{
+    const __m256 point_x = _mm256_set1_ps(x);
+    const __m256 point_y = _mm256_set1_ps(y);
+    const __m256 point_z = _mm256_set1_ps(z);
+    const __m256 cutoff = _mm256_set1_ps(cutoff_squared);
+
+    size_t hit_count = 0;
+    size_t c = 0;
+    for (; c + 8 <= count; c += 8)
+    {
+        __m256 delta_x = _mm256_sub_ps(point_x, _mm256_loadu_ps(candidate_x + c));
+        __m256 delta_y = _mm256_sub_ps(point_y, _mm256_loadu_ps(candidate_y + c));
+        __m256 delta_z = _mm256_sub_ps(point_z, _mm256_loadu_ps(candidate_z + c));
+        __m256 length_squared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(delta_x, delta_x), _mm256_mul_ps(delta_y, delta_y)), _mm256_mul_ps(delta_z, delta_z));
+        for (unsigned int mask = _mm256_movemask_ps(_mm256_cmp_ps(length_squared, cutoff, _CMP_LE_OQ)); mask != 0; mask &= mask - 1)
+            hits[hit_count++] = c + __builtin_ctz(mask);
+    }
+
+    return find_close_scalar(x, y, z, candidate_x, candidate_y, candidate_z, c, count, cutoff_squared, hits, hit_count);
+}
+
+// GCC 12 reports the undefined pass-through operand of the
+// AVX-512 intrinsics as uninitialized.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+/**
+ * @brief Sixteen springs per instruction with gathered loads and scattered stores.
+ */
+__attribute__((target("avx512f"))) static void distance_kernel_avx512(float *x, float *y, float *z, const DistanceConstraintBatch &batch)
+{
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+
+    size_t i = 0;
+    for (; i + 16 <= batch.count; i += 16)
+    {
+        __m512i v1 = _mm512_loadu_si512(batch.v1 + i);
+        __m512i v2 = _mm512_loadu_si512(batch.v2 + i);
+        __m512 x1 = _mm512_i32gather_ps(v1, x, 4);
+        __m512 y1 = _mm512_i32gather_ps(v1, y, 4);
+        __m512 z1 = _mm512_i32gather_ps(v1, z, 4);
+        __m512 x2 = _mm512_i32gather_ps(v2, x, 4);
+        __m512 y2 = _mm512_i32gather_ps(v2, y, 4);
+        __m512 z2 = _mm512_i32gather_ps(v2, z, 4);
+
+        __m512 delta_x = _mm512_sub_ps(x2, x1);
+        __m512 delta_y = _mm512_sub_ps(y2, y1);
+        __m512 delta_z = _mm512_sub_ps(z2, z1);
+        __m512 length_squared = _mm512_fmadd_ps(delta_z, delta_z, _mm512_fmadd_ps(delta_y, delta_y, _mm512_mul_ps(delta_x, delta_x)));
+
+        // Approximate 1 / length and refine it with one Newton step.
+        __m512 inverse_length = _mm512_rsqrt14_ps(length_squared);
+        inverse_length = _mm512_mul_ps(inverse_length, _mm512_fnmadd_ps(_mm512_mul_ps(half, length_squared), _mm512_mul_ps(inverse_length, inverse_length), three_halves));
+        __m512 length_v = _mm512_mul_ps(length_squared, inverse_length);
+        __m512 offset = _mm512_mul_ps(_mm512_sub_ps(length_v, _mm512_loadu_ps(batch.rest_distance + i)), inverse_length);
+
+        __m512 share1 = _mm512_mul_ps(offset, _mm512_loadu_ps(batch.share1 + i));
+        __m512 share2 = _mm512_mul_ps(offset, _mm512_loadu_ps(batch.share2 + i));
+
+        // No two lanes share a vertex, so the scatters can not collide.
+        _mm512_i32scatter_ps(x, v1, _mm512_fmadd_ps(delta_x, share1, x1), 4);
+        _mm512_i32scatter_ps(y, v1, _mm512_fmadd_ps(delta_y, share1, y1), 4);
+        _mm512_i32scatter_ps(z, v1, _mm512_fmadd_ps(delta_z, share1, z1), 4);
+        _mm512_i32scatter_ps(x, v2, _mm512_fnmadd_ps(delta_x, share2, x2), 4);
+        _mm512_i32scatter_ps(y, v2, _mm512_fnmadd_ps(delta_y, share2, y2), 4);
+        _mm512_i32scatter_ps(z, v2, _mm512_fnmadd_ps(delta_z, share2, z2), 4);
+    }
+
+    solve_scalar(x, y, z, batch, i);
+}
+#pragma GCC diagnostic pop
+#endif
+
+/**
+ * @returns The widest instruction set supported by this CPU.
+ *
+ * @brief Queries the CPU features via cpuid.
+ */
+SimdLevel detect_simd_level()
+{
+#ifdef DISTANCE_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::SSE;
+#endif
+    return SimdLevel::SCALAR;
+}
+
+/**
+ * @param level The instruction set to use. Must be supported by the CPU.
+ * @returns The distance constraint kernel for the given instruction set.
+ */
+DistanceKernel get_distance_kernel(SimdLevel level)
+{
+#ifdef DISTANCE_KERNEL_X86
+    switch (level)
+    {
+    case SimdLevel::AVX512:
+        return distance_kernel_avx512;
+    case SimdLevel::AVX2:
+        return distance_kernel_avx2;
+    case SimdLevel::SSE:
+        return distance_kernel_sse;
+    default:
+        break;
+    }
+#else
+    (void)level;
+#endif
+    return distance_kernel_scalar;
+}
+
+/**
+ * @param level The instruction set to use. Must be supported by the CPU.
+ * @returns The proximity kernel for the given instruction set. Ranges of candidates
+ * are short, so AVX-512 uses the eight lanes of the AVX2 kernel.
+ */
+ProximityKernel get_proximity_kernel(SimdLevel level)
+{
+#ifdef DISTANCE_KERNEL_X86
+    switch (level)
+    {
+    case SimdLevel::AVX512:
+    case SimdLevel::AVX2:
+        return proximity_kernel_avx2;
+    case SimdLevel::SSE:
+        return proximity_kernel_sse;
+    default:
+        break;
+    }
+#else
+    (void)level;
+#endif
+    return proximity_kernel_scalar;
+}
+
+/**
+ * @param level The instruction set.
+ * @returns A printable name of the instruction set.
+ */
+const char *get_simd_level_name(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::AVX512:
+        return "avx512";
+    case SimdLevel::AVX2:
+        return "avx2";
+    case SimdLevel::SSE:
+        return "sse";
+    default:
+        return "scalar";
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+
+// Instruction set used by the vectorized distance constraint kernel.
+enum SimdLevel
+{
+    SCALAR,
+    SSE,
+    AVX2,
+    AVX512
+};
+
+/**
+ * Springs laid out as a structure of arrays for the vectorized kernel.
+ * No two springs of a batch may share a vertex, so all lanes can be
+ * written back without conflicts.
+ * @brief A batch of independent distance constraints.
+ */
+struct DistanceConstraintBatch
+{
+    const unsigned int *v1;
+    const unsigned int *v2;
+    const float *rest_distance;
+    // Share of the correction applied to the first and second vertex.
+    const float *share1;
+    const float *share2;
+    size_t count;
+};
+
+// Solves every distance constraint of a batch in place on the given positions.
+typedef void (*DistanceKernel)(float *x, float *y, float *z, const DistanceConstraintBatch &batch);
+
+// Writes the offsets of the candidates not further than the cutoff from the point to hits,
+// in ascending order, and returns their number. hits must have room for count offsets.
+typedef size_t (*ProximityKernel)(float x, float y, float z, const float *candidate_x, const float *candidate_y,
+                                  const float *candidate_z, size_t count, float cutoff_squared, unsigned int *hits);
+
+SimdLevel detect_simd_level();
+DistanceKernel get_distance_kernel(SimdLevel level);
+ProximityKernel get_proximity_kernel(SimdLevel level);
+const char *get_simd_level_name(SimdLevel level);
@@ -0,0 +1,145 @@
+#include "frame_arena.h"
+#include <algorithm>
+#include <cassert>
+#include <memory>
+
+/**
+ * @brief Construct a new Frame Arena:: Frame Arena object
+ *
+ * @param initial_capacity The size of the first block in bytes
+ * @param _upstream The resource the blocks are taken from
+ */
+FrameArena::FrameArena(size_t initial_capacity, std::pmr::memory_resource *_upstream)
+{
+	assert(initial_capacity > 0);
+	upstream = _upstream;
+	high_water_mark = 0;
+	upstream_allocations = 0;
+	add_block(initial_capacity);
+	frame_bytes = 0;
+}
+
+/**
+ * @brief Destroy the Frame Arena:: Frame Arena object
+ * Returns all blocks to the upstream resource.
+ */
+FrameArena::~FrameArena()
+{
+	release_blocks();
+}
+
+/**
+ * @brief Start a new frame. Everything allocated before must not be used anymore.
+ * If the frame did not fit into the first block, all blocks are replaced by one
+ * that holds all of them.
+ */
+void FrameArena::reset()
+{
+	high_water_mark = std::max(high_water_mark, frame_bytes);
+	if (blocks.size() > 1)
+	{
+		size_t capacity = get_capacity();
+		release_blocks();
+		add_block(capacity);
+	}
+	current = static_cast<char *>(blocks.front().memory);
+	remaining = blocks.front().size;
+	frame_bytes = 0;
+}
+
+/**
+ * @returns The bytes of all blocks together.
+ */
+size_t FrameArena::get_capacity() const
+{
+	size_t capacity = 0;
+	for (const Block &block : blocks)
+		capacity += block.size;
+	return capacity;
+}
+
+/**
+ * @returns The most bytes used within one frame, including alignment padding.
+ * The frame in progress is included.
+ */
+size_t FrameArena::get_high_water_mark() const
+{
+	return std::max(high_water_mark, frame_bytes);
+}
+
+/**
+ * @returns The number of blocks taken from the upstream resource so far.
+ */
+size_t FrameArena::get_upstream_allocations() const
+{
+	return upstream_allocations;
+}
+
+/**
+ * @brief Take a new block from the upstream resource and continue in it.
+ *
+ * @param size The size of the block in bytes
+ */
+void FrameArena::add_block(size_t size)
+{
+	blocks.push_back({upstream->allocate(size, alignof(std::max_align_t)), size});
+	upstream_allocations++;
+	current = static_cast<char *>(blocks.back().memory);
+	remaining = size;
+}
+
+/**
+ * @brief Return all blocks to the upstream resource.
+ */
+void FrameArena::release_blocks()
+{
+	for (const Block &block : blocks)
+		upstream->deallocate(block.memory, block.size, alignof(std::max_align_t));
+	blocks.clear();
+}
+
+/**
+ * @brief Hand out the next bytes of the current block. If they do not fit, continue in
+ * a new block, at least as large as the blocks so far.
+ *
+ * @param bytes The size of the allocation
+ * @param alignment The alignment of the allocation, a power of two
+ * @return void* The memory, valid until the next reset
+ */
+void *FrameArena::do_allocate(size_t bytes, size_t alignment)
+{
+	void *memory = current;
+	size_t space = remaining;
+	if (!std::align(alignment, bytes, memory, space))
+	{
+		// The unused rest of the full block counts as used, it is lost for this frame.
+		frame_bytes += remaining;
+		add_block(std::max(bytes + alignment, get_capacity()));
+		memory = current;
+		space = remaining;
+		std::align(alignment, bytes, memory, space);
+	}
+
+	frame_bytes += remaining - space + bytes;
+	current = static_cast<char *>(memory) + bytes;
+	remaining = space - bytes;
+	return memory;
+}
+
+/**
+ * @brief Single allocations are not freed, their memory returns with the next reset.
+ */
+void FrameArena::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+	(void)p;
+	(void)bytes;
+	(void)alignment;
+}
+
+/**
+ * @returns If memory of one resource can be freed by the other, only for the same arena.
+ */
+bool FrameArena::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+	return this == &other;
+}
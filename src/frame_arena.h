@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+/**
+ * Hands out memory by advancing a pointer through a block and never frees single
+ * allocations. reset() at the end of a frame makes the whole block available again.
+ * If a frame needed more than the block, the extra blocks are merged into one block
+ * of the combined size on the next reset, so once the largest frame was seen, the
+ * arena does not touch the upstream resource anymore.
+ * Use it through std::pmr containers for temporaries that die within a frame.
+ * @brief Monotonic per frame arena, usable as std::pmr memory resource.
+ */
+class FrameArena : public std::pmr::memory_resource
+{
+public:
+	FrameArena(size_t initial_capacity = 64 * 1024, std::pmr::memory_resource *upstream = std::pmr::new_delete_resource());
+	~FrameArena();
+	FrameArena(const FrameArena &) = delete;
+	FrameArena &operator=(const FrameArena &) = delete;
+
+	// Invalidates everything allocated since the last reset.
+	void reset();
+
+	// Bytes of all blocks together.
+	size_t get_capacity() const;
+	// Most bytes used within one frame, including alignment padding.
+	size_t get_high_water_mark() const;
+	// Number of blocks requested from the upstream resource so far.
+	size_t get_upstream_allocations() const;
+
+private:
+	struct Block
+	{
+		void *memory;
+		size_t size;
+	};
+
+	std::pmr::memory_resource *upstream;
+	// The first block is the one reset() returns to, the others were added in this frame.
+	std::vector<Block> blocks;
+	// Free part of the last block.
+	char *current;
+	size_t remaining;
+	size_t frame_bytes;
+	size_t high_water_mark;
+	size_t upstream_allocations;
+
+	void add_block(size_t size);
+	void release_blocks();
+
+	void *do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+};
@@ -0,0 +1,168 @@
+#include "huge_page_allocator.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include "allocation_tracker.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// Alignment of the allocations below the threshold, a cache line.
+static const size_t small_alignment = 64;
+// Distance between the offsets of consecutive mappings, a page and a cache line.
+static const size_t mapping_offset_stride = 4096 + 64;
+
+#if defined(__linux__)
+
+// Start and size of every live mapping.
+static std::mutex mappings_mutex;
+static std::map<uintptr_t, size_t> mappings;
+// Number of mappings so far, selects the offset of the next allocation into its mapping.
+static std::atomic<unsigned int> mapping_count = 0;
+
+/**
+ * @param bytes The size of the allocation.
+ * @returns The size of its mapping, rounded up to whole huge pages.
+ */
+static size_t get_mapping_size(size_t bytes)
+{
+	return (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+}
+
+/**
+ * @brief Map memory aligned to a huge page and ask the kernel to back it with huge pages.
+ * Maps one huge page more than needed and unmaps the unaligned ends.
+ * The pages are not touched, they are backed on the first write.
+ * Within a huge page, virtual and physical addresses agree in the lower 21 bits, so
+ * arrays starting at the beginning of their mappings would all map to the same cache
+ * sets, and the loops reading x[i], y[i], z[i], ... together would evict each other.
+ * Every allocation therefore starts at a different offset into its mapping, which
+ * differs from the others in both the page offset and the page.
+ *
+ * @param bytes The size of the allocation
+ * @return void* The memory, aligned to a cache line
+ */
+void *allocate_huge_pages(size_t bytes)
+{
+	if (bytes < huge_page_threshold)
+		return ::operator new(bytes, std::align_val_t(small_alignment));
+
+	size_t offset = mapping_count.fetch_add(1, std::memory_order_relaxed) % 64 * mapping_offset_stride;
+	size_t size = get_mapping_size(offset + bytes);
+	void *mapping = mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		throw std::bad_alloc();
+
+	uintptr_t begin = reinterpret_cast<uintptr_t>(mapping);
+	uintptr_t aligned = (begin + huge_page_size - 1) / huge_page_size * huge_page_size;
+	if (aligned > begin)
+		munmap(mapping, aligned - begin);
+	munmap(reinterpret_cast<void *>(aligned + size), begin + huge_page_size - aligned);
+
+	// Without transparent huge page support this fails and the mapping keeps small pages.
+	madvise(reinterpret_cast<void *>(aligned), size, MADV_HUGEPAGE);
+
+	try
+	{
+		std::lock_guard<std::mutex> lock(mappings_mutex);
+		mappings[aligned] = size;
+	}
+	catch (...)
+	{
+		munmap(reinterpret_cast<void *>(aligned), size);
+		throw;
+	}
+	track_allocation(size);
+	return reinterpret_cast<void *>(aligned + offset);
+}
+
+/**
+ * @brief Free memory of allocate_huge_pages().
+ *
+ * @param memory The memory, may be nullptr
+ * @param bytes The size it was allocated with
+ */
+void deallocate_huge_pages(void *memory, size_t bytes) noexcept
+{
+	if (memory == nullptr)
+		return;
+	if (bytes < huge_page_threshold)
+	{
+		::operator delete(memory, std::align_val_t(small_alignment));
+		return;
+	}
+
+	// The offset into the mapping is less than a huge page.
+	uintptr_t aligned = reinterpret_cast<uintptr_t>(memory) / huge_page_size * huge_page_size;
+	size_t size;
+	{
+		std::lock_guard<std::mutex> lock(mappings_mutex);
+		auto mapping = mappings.find(aligned);
+		size = mapping->second;
+		mappings.erase(mapping);
+	}
+	munmap(reinterpret_cast<void *>(aligned), size);
+	track_deallocation();
+}
+
+/**
+ * @returns The live mappings and how many huge pages back them.
+ * The kernel may merge neighboring mappings into one area, which is counted once.
+ */
+HugePageStatistics get_huge_page_statistics()
+{
+	HugePageStatistics statistics;
+	std::lock_guard<std::mutex> lock(mappings_mutex);
+	for (const auto &[begin, size] : mappings)
+	{
+		statistics.mappings++;
+		statistics.mapped_bytes += size;
+	}
+
+	std::ifstream smaps("/proc/self/smaps");
+	std::string line;
+	bool counted = false;
+	while (std::getline(smaps, line))
+	{
+		unsigned long area_begin, area_end;
+		if (std::sscanf(line.c_str(), "%lx-%lx ", &area_begin, &area_end) == 2)
+		{
+			// An area is counted if it overlaps any of the mappings.
+			auto next = mappings.lower_bound(area_end);
+			counted = next != mappings.begin() && std::prev(next)->first + std::prev(next)->second > area_begin;
+			continue;
+		}
+
+		unsigned long kilobytes;
+		if (counted && std::sscanf(line.c_str(), "AnonHugePages: %lu kB", &kilobytes) == 1)
+			statistics.huge_page_bytes += kilobytes * 1024;
+	}
+	statistics.huge_pages = statistics.huge_page_bytes / huge_page_size;
+	return statistics;
+}
+
+#else
+
+void *allocate_huge_pages(size_t bytes)
+{
+	return ::operator new(bytes, std::align_val_t(small_alignment));
+}
+
+void deallocate_huge_pages(void *memory, size_t bytes) noexcept
+{
+	(void)bytes;
+	::operator delete(memory, std::align_val_t(small_alignment));
+}
+
+HugePageStatistics get_huge_page_statistics()
+{
+	return {};
+}
+
+#endif
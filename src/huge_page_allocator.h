@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "thread_pool.h"
+
+// Size of a transparent huge page, 2 MiB on x86-64.
+constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+// Allocations of at least this size get their own mapping, rounded up to whole huge
+// pages. At most half of the mapping is wasted.
+constexpr size_t huge_page_threshold = huge_page_size / 2;
+
+// State of the mappings handed out by allocate_huge_pages().
+struct HugePageStatistics
+{
+	// Live allocations with their own mapping and the bytes mapped for them.
+	size_t mappings = 0;
+	size_t mapped_bytes = 0;
+	// Part of the mapped bytes the kernel currently backs with huge pages.
+	size_t huge_page_bytes = 0;
+	size_t huge_pages = 0;
+};
+
+// Allocations of at least huge_page_threshold bytes are mapped aligned to a huge page
+// and marked with madvise(MADV_HUGEPAGE), so the kernel backs them with transparent
+// huge pages on the first touch. Smaller allocations and other platforms get
+// cache line aligned memory from operator new.
+void *allocate_huge_pages(size_t bytes);
+void deallocate_huge_pages(void *memory, size_t bytes) noexcept;
+
+// Reads the huge pages actually backing the mappings from /proc/self/smaps. Slow,
+// meant for reports. Without huge page support, only the mapping counts are filled.
+HugePageStatistics get_huge_page_statistics();
+
+/**
+ * Large arrays touch many pages, so with 4 KiB pages the loops over them miss the
+ * TLB all the time. Backed by huge pages, a 2 MiB stretch needs a single TLB entry.
+ * Unlike std::allocator, elements created without a value are default initialized,
+ * so growing a vector of floats does not write its new pages. They are only placed
+ * on a NUMA node once they are written, which lets the threads working on them touch
+ * them first, see distribute_pages().
+ * @brief Allocator backing large arrays with transparent huge pages.
+ */
+template <typename T>
+class HugePageAllocator
+{
+public:
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind
+	{
+		typedef HugePageAllocator<U> other;
+	};
+
+	HugePageAllocator() noexcept = default;
+	template <typename U>
+	HugePageAllocator(const HugePageAllocator<U> &) noexcept {}
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(allocate_huge_pages(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n) noexcept
+	{
+		deallocate_huge_pages(p, n * sizeof(T));
+	}
+
+	template <typename U>
+	void construct(U *p) noexcept(std::is_nothrow_default_constructible_v<U>)
+	{
+		::new (static_cast<void *>(p)) U;
+	}
+
+	template <typename U, typename... Args>
+	void construct(U *p, Args &&...args)
+	{
+		::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+	}
+
+	template <typename U>
+	bool operator==(const HugePageAllocator<U> &) const noexcept
+	{
+		return true;
+	}
+};
+
+// Vector for arrays with one entry per particle or spring. resize() without a value
+// leaves new elements of trivial types uninitialized.
+template <typename T>
+using huge_page_vector = std::vector<T, HugePageAllocator<T>>;
+
+/**
+ * Copies the array into fresh memory which the threads of the pool write first, split
+ * like the loops over the array. Every page is then backed before the simulation uses
+ * it and lies on the NUMA node of the thread that works on it.
+ * @brief Back the pages of an array from the threads of a pool.
+ *
+ * @param array The array, keeps its contents
+ * @param thread_pool The threads which will work on the array
+ */
+template <typename T>
+void distribute_pages(huge_page_vector<T> &array, ThreadPool &thread_pool)
+{
+	// Not initialized, so the pages are not touched yet.
+	huge_page_vector<T> distributed(array.size());
+	const T *source = array.data();
+	T *target = distributed.data();
+	thread_pool.parallel_for(0, array.size(), [&](size_t begin, size_t end)
+							 { std::copy(source + begin, source + end, target + begin); }, 4096);
+	array.swap(distributed);
+}
@@ -3,7 +3,12 @@
 #include <filesystem>
 #include <thread>
 #include <charconv>
-#include "config.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
 #include "linear_algebra.h"
 
 #ifdef _WIN32
@@ -0,0 +1,105 @@
+#include "particle_store.h"
+#include <cassert>
+#include <algorithm>
+#include "thread_pool.h"
+
+/**
+ * @brief Construct a new Particle Store:: Particle Store object
+ *
+ * @param size The number of particles.
+ */
+ParticleStore::ParticleStore(size_t size)
+{
+    resize(size);
+}
+
+/**
+ * @brief Resize all arrays to the given number of particles.
+ * New particles are at rest in the origin and have an inverse mass of 1.
+ *
+ * @param size The number of particles.
+ */
+void ParticleStore::resize(size_t size)
+{
+    x.resize(size, 0.0f);
+    y.resize(size, 0.0f);
+    z.resize(size, 0.0f);
+    old_x.resize(size, 0.0f);
+    old_y.resize(size, 0.0f);
+    old_z.resize(size, 0.0f);
+    velocity_x.resize(size, 0.0f);
+    velocity_y.resize(size, 0.0f);
+    velocity_z.resize(size, 0.0f);
+    inverse_mass.resize(size, 1.0f);
+}
+
+/**
+ * @returns The number of particles.
+ */
+size_t ParticleStore::size() const
+{
+    return x.size();
+}
+
+/**
+ * @brief Copy positions into the working position arrays.
+ *
+ * @param positions The positions, one per particle.
+ */
+void ParticleStore::load_positions(std::span<const vec3> positions)
+{
+    assert(positions.size() == size());
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        x[i] = positions[i].entries[0];
+        y[i] = positions[i].entries[1];
+        z[i] = positions[i].entries[2];
+    }
+}
+
+/**
+ * @brief Copy the working positions out of the store.
+ *
+ * @param positions Output positions, must hold one entry per particle.
+ */
+void ParticleStore::store_positions(std::span<vec3> positions) const
+{
+    assert(positions.size() == size());
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        positions[i] = {x[i], y[i], z[i]};
+    }
+}
+
+/**
+ * @brief Compute the inverse masses from the given masses.
+ *
+ * @param masses The particle masses, one per particle.
+ */
+void ParticleStore::load_inverse_masses(const std::vector<float> &masses)
+{
+    assert(masses.size() == size());
+    for (size_t i = 0; i < masses.size(); i++)
+    {
+        inverse_mass[i] = 1.0f / masses[i];
+    }
+}
+
+/**
+ * @brief Copy every array into fresh memory, written by the thread pool with the split
+ * of the loops over the particles. A page is placed on the NUMA node of the thread
+ * writing it first, so each thread finds its share of the particles in local memory.
+ * The granularity is a page, 2 MiB for the arrays backed by huge pages.
+ * With a single thread, all pages already are where they are used.
+ *
+ * @param thread_pool The threads which will work on the particles
+ */
+void ParticleStore::distribute(ThreadPool &thread_pool)
+{
+    if (thread_pool.get_thread_count() == 1)
+        return;
+
+    for (huge_page_vector<float> *array : {&x, &y, &z, &old_x, &old_y, &old_z,
+                                           &velocity_x, &velocity_y, &velocity_z, &inverse_mass})
+        distribute_pages(*array, thread_pool);
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <span>
+#include <vector>
+#include "huge_page_allocator.h"
+#include "linear_algebra.h"
+
+class ThreadPool;
+
+/**
+ * Stores the per particle simulation data as a structure of arrays.
+ * Every component lives in its own cache line aligned float array, such that
+ * loops over the particles access memory contiguously and can be vectorized.
+ * Arrays of large meshes are backed by huge pages.
+ * @brief Structure of arrays particle storage.
+ */
+class ParticleStore
+{
+public:
+    ParticleStore(size_t size = 0);
+
+    void resize(size_t size);
+    size_t size() const;
+
+    void load_positions(std::span<const vec3> positions);
+    void store_positions(std::span<vec3> positions) const;
+    void load_inverse_masses(const std::vector<float> &masses);
+
+    // Moves the pages of every array to the NUMA node of the thread working on them.
+    void distribute(ThreadPool &thread_pool);
+
+    inline vec3 get_position(size_t i) const
+    {
+        return {x[i], y[i], z[i]};
+    }
+
+    inline void set_position(size_t i, const vec3 &v)
+    {
+        x[i] = v.entries[0];
+        y[i] = v.entries[1];
+        z[i] = v.entries[2];
+    }
+
+    // Working positions.
+    huge_page_vector<float> x, y, z;
+    // Positions at the start of the current substep.
+    huge_page_vector<float> old_x, old_y, old_z;
+    huge_page_vector<float> velocity_x, velocity_y, velocity_z;
+    // Inverse of the particle masses.
+    huge_page_vector<float> inverse_mass;
+};
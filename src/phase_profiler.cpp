@@ -0,0 +1,169 @@
+#include "phase_profiler.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+/**
+ * @returns The name of the phase, for reports.
+ */
+const char *get_profile_phase_name(ProfilePhase phase)
+{
+	switch (phase)
+	{
+	case PROFILE_UPDATE:
+		return "update";
+	case PROFILE_INTEGRATION:
+		return "integration";
+	case PROFILE_SPRINGS:
+		return "springs";
+	case PROFILE_BROAD_PHASE:
+		return "broad phase";
+	case PROFILE_COLLISION:
+		return "collision";
+	case PROFILE_VELOCITIES:
+		return "velocities";
+	case PROFILE_NORMALS:
+		return "normals";
+	case PROFILE_UPLOAD:
+		return "upload";
+	case PROFILE_DRAW:
+		return "draw";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * @brief Construct a new Phase Profiler:: Phase Profiler object
+ *
+ * @param _window The number of recent frames the statistics are computed over
+ */
+PhaseProfiler::PhaseProfiler(size_t _window)
+{
+	assert(_window > 0);
+	window = _window;
+	samples.resize(PROFILE_PHASE_COUNT * window);
+	sorted_samples.reserve(window);
+	active_phases.fill(false);
+	next_sample.fill(0);
+	begin_frame();
+}
+
+/**
+ * @brief Start recording a new frame.
+ */
+void PhaseProfiler::begin_frame()
+{
+	frame_times.fill(std::chrono::steady_clock::duration::zero());
+}
+
+/**
+ * @brief Add time spent in a phase to the frame in progress.
+ *
+ * @param phase The phase
+ * @param time The time spent in it
+ */
+void PhaseProfiler::add(ProfilePhase phase, std::chrono::steady_clock::duration time)
+{
+	frame_times[phase] += time;
+	active_phases[phase] = true;
+}
+
+/**
+ * @brief Finish the frame in progress and store its times, replacing the oldest frame
+ * once the window is full.
+ */
+void PhaseProfiler::end_frame()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++)
+	{
+		if (!active_phases[phase])
+			continue;
+		float milliseconds = std::chrono::duration<float, std::milli>(frame_times[phase]).count();
+		samples[phase * window + next_sample[phase] % window] = milliseconds;
+		next_sample[phase]++;
+	}
+}
+
+/**
+ * @returns The minimum, mean, median, 99th percentile and maximum time per frame of
+ * the phase over the recorded frames in the window. All 0 if none was recorded.
+ * The percentiles are the nearest ranks.
+ *
+ * @param phase The phase
+ */
+PhaseStatistics PhaseProfiler::get_statistics(ProfilePhase phase) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	PhaseStatistics statistics;
+	statistics.frames = std::min<uint64_t>(next_sample[phase], window);
+	if (statistics.frames == 0)
+		return statistics;
+
+	const float *first = samples.data() + phase * window;
+	sorted_samples.assign(first, first + statistics.frames);
+	double sum = 0.0;
+	for (float sample : sorted_samples)
+		sum += sample;
+	statistics.mean = sum / statistics.frames;
+
+	// The rank of percentile q is ceil(q * frames), counted from 1.
+	auto percentile = [&](double q)
+	{
+		size_t rank = std::max<size_t>(std::ceil(q * statistics.frames), 1);
+		std::nth_element(sorted_samples.begin(), sorted_samples.begin() + rank - 1, sorted_samples.end());
+		return sorted_samples[rank - 1];
+	};
+	statistics.min = percentile(0.0);
+	statistics.p50 = percentile(0.5);
+	statistics.p99 = percentile(0.99);
+	statistics.max = percentile(1.0);
+	return statistics;
+}
+
+/**
+ * @returns The number of recent frames the statistics are computed over.
+ */
+size_t PhaseProfiler::get_window() const
+{
+	return window;
+}
+
+/**
+ * @brief Forget all recorded frames, e.g. after the settings changed.
+ */
+void PhaseProfiler::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	active_phases.fill(false);
+	next_sample.fill(0);
+}
+
+/**
+ * @brief Write the column names of write_csv().
+ *
+ * @param out The stream to write to
+ */
+void PhaseProfiler::write_csv_header(std::ostream &out)
+{
+	out << "phase,frames,min_ms,mean_ms,p50_ms,p99_ms,max_ms" << std::endl;
+}
+
+/**
+ * @brief Write the statistics of every phase with recorded frames, one line each.
+ *
+ * @param out The stream to write to
+ */
+void PhaseProfiler::write_csv(std::ostream &out) const
+{
+	for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++)
+	{
+		PhaseStatistics statistics = get_statistics(static_cast<ProfilePhase>(phase));
+		if (statistics.frames == 0)
+			continue;
+		out << get_profile_phase_name(static_cast<ProfilePhase>(phase)) << "," << statistics.frames
+			<< "," << statistics.min << "," << statistics.mean << "," << statistics.p50
+			<< "," << statistics.p99 << "," << statistics.max << std::endl;
+	}
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Timed parts of a frame. Phases nest: the update contains all physics phases,
+// the collision contains the broad phase.
+enum ProfilePhase
+{
+	// A whole PhysicsEngine::update().
+	PROFILE_UPDATE,
+	PROFILE_INTEGRATION,
+	PROFILE_SPRINGS,
+	// Update of the broad phase, e.g. building the spatial hash.
+	PROFILE_BROAD_PHASE,
+	// Neighbor lists and collision response of the self collision.
+	PROFILE_COLLISION,
+	PROFILE_VELOCITIES,
+	// Normals, buffer uploads and draw call of ClothMesh::draw().
+	PROFILE_NORMALS,
+	PROFILE_UPLOAD,
+	PROFILE_DRAW,
+	PROFILE_PHASE_COUNT
+};
+
+const char *get_profile_phase_name(ProfilePhase phase);
+
+// Time spent in a phase per frame over the recent frames, in milliseconds.
+struct PhaseStatistics
+{
+	size_t frames = 0;
+	double min = 0.0;
+	double mean = 0.0;
+	double p50 = 0.0;
+	double p99 = 0.0;
+	double max = 0.0;
+};
+
+/**
+ * The time of every phase is summed up over a frame, e.g. over all substeps, and
+ * kept for the last frames in a ring buffer allocated up front, so profiling does
+ * not allocate. Frames are recorded by one thread, the statistics may be queried
+ * from any thread.
+ * @brief Rolling per frame statistics of the time spent in each phase.
+ */
+class PhaseProfiler
+{
+public:
+	PhaseProfiler(size_t window = 512);
+	PhaseProfiler(const PhaseProfiler &) = delete;
+	PhaseProfiler &operator=(const PhaseProfiler &) = delete;
+
+	// Recording, only called by the thread running the frames.
+	void begin_frame();
+	void add(ProfilePhase phase, std::chrono::steady_clock::duration time);
+	void end_frame();
+	void clear();
+
+	PhaseStatistics get_statistics(ProfilePhase phase) const;
+	size_t get_window() const;
+
+	// One line per phase with recorded frames.
+	static void write_csv_header(std::ostream &out);
+	void write_csv(std::ostream &out) const;
+
+private:
+	size_t window;
+	// Time of each phase in the frame in progress.
+	std::array<std::chrono::steady_clock::duration, PROFILE_PHASE_COUNT> frame_times;
+	// Phases which were entered in any frame so far. From then on, every frame records
+	// a sample for them, 0 if the phase was skipped, e.g. the broad phase between rebuilds.
+	std::array<bool, PROFILE_PHASE_COUNT> active_phases;
+
+	// Guards everything below.
+	mutable std::mutex mutex;
+	// Milliseconds per frame of each phase, window entries per phase. The last
+	// sample of phase p is at samples[p * window + (next_sample[p] - 1) % window].
+	std::vector<float> samples;
+	std::array<uint64_t, PROFILE_PHASE_COUNT> next_sample;
+	// Space to sort the samples of one phase for the percentiles.
+	mutable std::vector<float> sorted_samples;
+};
+
+/**
+ * @brief Adds the time until the end of its scope to a phase of a profiler.
+ * Does nothing without a profiler.
+ */
+class ProfileScope
+{
+public:
+	ProfileScope(PhaseProfiler *profiler, ProfilePhase phase)
+	{
+		this->profiler = profiler;
+		this->phase = phase;
+		if (profiler != nullptr)
+			start = std::chrono::steady_clock::now();
+	}
+
+	~ProfileScope()
+	{
+		if (profiler != nullptr)
+			profiler->add(phase, std::chrono::steady_clock::now() - start);
+	}
+
+	ProfileScope(const ProfileScope &) = delete;
+	ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+	PhaseProfiler *profiler;
+	ProfilePhase phase;
+	std::chrono::steady_clock::time_point start;
+};
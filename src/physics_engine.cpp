@@ -2,6 +2,13 @@
 #include <time.h>
 #include <unordered_set>
 #include <cassert>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cmath>
+#include "allocation_tracker.h"
+#include "dense_grid.h"
+#include "sweep_and_prune.h"
 
 /**
  * @brief Construct a new Physics Engine:: Physics Engine object
@@ -10,14 +17,39 @@
  * @param _gravity Gravitational force to be simulated
  * @param _mount Determines which points of the cloth are fixed in place
  */
-PhysicsEngine::PhysicsEngine(ClothMesh *cloth, vec3 _gravity, MountingType _mount) : cloth(cloth)
+PhysicsEngine::PhysicsEngine(ClothState *cloth, vec3 _gravity, MountingType _mount) : cloth(cloth)
 {
     gravity = _gravity;
     mount = _mount;
-    velocity = std::vector<vec3>(cloth->get_vertex_positions().size(), {0.f, 0.f, 0.f});
-    old_position = std::vector<vec3>(cloth->get_vertex_positions().size(), {0.0f, 0.0f, 0.0f});
+    particles.resize(cloth->get_vertex_positions().size());
+    particles.load_positions(cloth->get_vertex_positions());
+    particles.load_inverse_masses(cloth->get_mass_ref());
+    pin_vertices();
+    compute_spring_shares();
+    // The mean spring length, so the radius does not depend on the order of the springs.
+    const huge_page_vector<float> &rest_distance = cloth->get_rest_distance_ref();
+    mean_rest_distance = std::accumulate(rest_distance.begin(), rest_distance.end(), 0.0) / rest_distance.size();
+    particle_radius = mean_rest_distance / 3.f;
+    neighbor_list_rebuilds = 0;
+    set_collision_exclusion_rings(1);
+    broad_phase_type = BroadPhaseType::SPATIAL_HASH;
+    spatial_hash_mode = SpatialHashMode::SPARSE_TABLE;
+    spatial_hash_rebuild_fraction = 0.1f;
+    simd_level = detect_simd_level();
+    distance_kernel = get_distance_kernel(simd_level);
+    set_neighbor_skin(2.0f);
     substeps = 20;
     delta_time = 1.0f;
+    solver = ConstraintSolver::GAUSS_SEIDEL;
+    solver_iterations = 1;
+    jacobi_sweeps = 6;
+    chebyshev_rho = 0.9f;
+    self_collision = true;
+    specialized_step = true;
+    thread_pool = std::make_unique<ThreadPool>();
+    build_spring_batches();
+    distribute_buffers();
+    select_update_step();
 }
 
 /**
@@ -36,222 +68,1297 @@ void PhysicsEngine::update()
     }
 
     // Determine the time step since last update.
-    delta_time = std::chrono::duration_cast<std::chrono::microseconds>(current_time - last_update).count() / 1000000.0f;
+    float frame_time = std::chrono::duration_cast<std::chrono::microseconds>(current_time - last_update).count() / 1000000.0f;
     last_update = current_time;
 
-    std::vector<vec3> vertex_positions = cloth->get_vertex_positions();
-    float spacing = cloth->get_rest_distance_ref()[0];
+    update(frame_time);
+}
+
+/**
+ * @brief Advance the simulation by a fixed time step.
+ * Unlike update(), this does not depend on the wall clock, which makes
+ * simulation runs reproducible (e.g. for benchmarking).
+ *
+ * @param _delta_time The simulated time in seconds.
+ */
+void PhysicsEngine::update(float _delta_time)
+{
+    delta_time = _delta_time;
 
-    for (int i = 0; i < substeps; i++)
+    profiler.begin_frame();
     {
-        // Create hash map for efficient self collision checking. Each hash map cell has
-        // one point in the default cloth state.
-        SpatialHashStructure structure(vertex_positions, spacing, 20 * vertex_positions.size());
-        update_step(vertex_positions, structure);
+        ProfileScope profile_scope(&profiler, ProfilePhase::PROFILE_UPDATE);
+        float step_time = delta_time / substeps;
+        for (int i = 0; i < substeps; i++)
+        {
+            if (specialized_step)
+                (this->*step_function)(step_time);
+            else
+                update_step_generic(step_time);
+        }
+        // The particles keep the positions between updates, the cloth only shows them.
+        particles.store_positions(cloth->get_back_vertex_positions());
+        cloth->swap_vertex_positions();
     }
-    cloth->set_vertex_positions(vertex_positions);
+    profiler.end_frame();
 }
 
 /**
- * @brief Internal logic to update the physics engine
- * In this function, the physics engine is updated by a single step. This function is called by the update function.
- * Here, the physics engine updates the position of the cloth vertices based on the velocity and gravity.
- * Afterwards, the physics engine applies constraints to the cloth vertices to simulate the cloth's behavior.
+ * @returns The number of particles held in place by the mount.
  */
-void PhysicsEngine::update_step(std::vector<vec3> &vertex_positions, const SpatialHashStructure &structure)
+size_t PhysicsEngine::get_pinned_count() const
 {
-    // Determine simulation time for this substep.
-    float step_time = delta_time / substeps;
-    size_t size = vertex_positions.size();
+    return std::count(particles.inverse_mass.begin(), particles.inverse_mass.end(), 0.0f);
+}
 
-    // Simulation Position Update
-    // For each particle in our system, determine our new velocity
-    // and update the position accordingly.
-    for (size_t i = 0; i < size; i++)
-    {
-        if (is_fixed(size, i))
-            continue;
+/**
+ * @brief Set the number of substeps simulated per update.
+ *
+ * @param _substeps The number of substeps, must be positive.
+ */
+void PhysicsEngine::set_substeps(int _substeps)
+{
+    assert(_substeps > 0);
+    substeps = _substeps;
+}
 
-        // reduce velocity by resistance to guarantee a steady state.
-        // Also acts as air resistance.
-        velocity[i] -= velocity[i] * 0.8f * step_time;
+/**
+ * @returns The number of substeps simulated per update.
+ */
+int PhysicsEngine::get_substeps() const
+{
+    return substeps;
+}
 
-        // add gravity to velocity
-        velocity[i] += gravity * step_time;
+/**
+ * @brief Set the method used to solve the distance constraints.
+ *
+ * @param _solver The constraint solver.
+ */
+void PhysicsEngine::set_constraint_solver(ConstraintSolver _solver)
+{
+    bool jacobi_buffers = solver == ConstraintSolver::JACOBI;
+    solver = _solver;
+    if (solver == ConstraintSolver::JACOBI && !jacobi_buffers)
+        distribute_buffers();
+    select_update_step();
+}
+
+/**
+ * @returns The method used to solve the distance constraints.
+ */
+ConstraintSolver PhysicsEngine::get_constraint_solver() const
+{
+    return solver;
+}
+
+/**
+ * @brief Set how often the distance constraints are solved per substep.
+ *
+ * @param iterations The number of iterations, must be positive.
+ */
+void PhysicsEngine::set_solver_iterations(int iterations)
+{
+    assert(iterations > 0);
+    solver_iterations = iterations;
+}
+
+/**
+ * @returns How often the distance constraints are solved per substep.
+ */
+int PhysicsEngine::get_solver_iterations() const
+{
+    return solver_iterations;
+}
+
+/**
+ * @brief Set how many Jacobi iterations the Jacobi solver runs per constraint iteration.
+ * Each costs about as much as an iteration of the other solvers.
+ *
+ * @param sweeps The number of Jacobi iterations, must be positive.
+ */
+void PhysicsEngine::set_jacobi_sweeps(int sweeps)
+{
+    assert(sweeps > 0);
+    jacobi_sweeps = sweeps;
+}
 
-        // save old position
-        old_position[i] = vertex_positions[i];
+/**
+ * @returns How many Jacobi iterations the Jacobi solver runs per constraint iteration.
+ */
+int PhysicsEngine::get_jacobi_sweeps() const
+{
+    return jacobi_sweeps;
+}
 
-        // update vertex position
-        vertex_positions[i] += velocity[i] * step_time;
+/**
+ * @brief Set the spectral radius estimate used by the Chebyshev acceleration of the Jacobi solver.
+ * Values closer to 1 extrapolate further. Larger estimates than max_chebyshev_rho made
+ * the solver diverge into NaN positions, so the estimate is clamped to [0, max_chebyshev_rho].
+ * Within that range, the solver still falls back to plain steps whenever the residual
+ * grows, see solve_distance_constraints_jacobi(). 0 disables the acceleration.
+ *
+ * @param rho The spectral radius estimate.
+ */
+void PhysicsEngine::set_chebyshev_rho(float rho)
+{
+    chebyshev_rho = std::clamp(rho, 0.0f, max_chebyshev_rho);
+}
+
+/**
+ * @returns The spectral radius estimate used by the Chebyshev acceleration.
+ */
+float PhysicsEngine::get_chebyshev_rho() const
+{
+    return chebyshev_rho;
+}
+
+/**
+ * @brief Turn the collisions between the particles of the cloth on or off.
+ * Without them, the substep skips the broad phase and the neighbor lists entirely.
+ *
+ * @param enabled If the particles collide with each other.
+ */
+void PhysicsEngine::set_self_collision(bool enabled)
+{
+    self_collision = enabled;
+    neighbor_reference_x.clear();
+    select_update_step();
+}
+
+/**
+ * @returns If the particles collide with each other.
+ */
+bool PhysicsEngine::get_self_collision() const
+{
+    return self_collision;
+}
+
+/**
+ * @brief Choose between the substep compiled for the current settings and the generic
+ * one, which checks the settings in every phase. Both compute the same result.
+ *
+ * @param specialized If the specialized substep is used.
+ */
+void PhysicsEngine::set_specialized_step(bool specialized)
+{
+    specialized_step = specialized;
+}
+
+/**
+ * @returns If the substep compiled for the current settings is used.
+ */
+bool PhysicsEngine::get_specialized_step() const
+{
+    return specialized_step;
+}
+
+/**
+ * @brief Set the skin of the self collision neighbor lists.
+ * A larger skin rebuilds the lists less often, but tests more candidates.
+ *
+ * @param skin The skin in particle radii, 0 disables the neighbor lists.
+ */
+void PhysicsEngine::set_neighbor_skin(float skin)
+{
+    assert(skin >= 0.0f);
+    neighbor_skin = skin;
+    reset_broad_phase();
+}
+
+/**
+ * @returns The skin of the self collision neighbor lists in particle radii.
+ */
+float PhysicsEngine::get_neighbor_skin() const
+{
+    return neighbor_skin;
+}
+
+/**
+ * @brief Set how far apart in the mesh two particles have to be to collide with each other.
+ * Particles sharing a triangle edge are one ring apart. Their distance is held by the
+ * springs, testing them only costs time and fights the distance constraints.
+ *
+ * @param rings The number of rings around every particle excluded from its collisions, 0 excludes none.
+ */
+void PhysicsEngine::set_collision_exclusion_rings(unsigned int rings)
+{
+    exclusion_rings = rings;
+    build_collision_exclusions();
+    neighbor_reference_x.clear();
+}
+
+/**
+ * @returns The number of rings around every particle excluded from its collisions.
+ */
+unsigned int PhysicsEngine::get_collision_exclusion_rings() const
+{
+    return exclusion_rings;
+}
+
+/**
+ * @brief Set how the spatial hash of the self collisions stores its cells.
+ * The sparse table is sized by the particle count, the compact mode by the occupied cells.
+ *
+ * @param mode The storage mode.
+ */
+void PhysicsEngine::set_spatial_hash_mode(SpatialHashMode mode)
+{
+    spatial_hash_mode = mode;
+    reset_broad_phase();
+}
+
+/**
+ * @returns How the spatial hash of the self collisions stores its cells.
+ */
+SpatialHashMode PhysicsEngine::get_spatial_hash_mode() const
+{
+    return spatial_hash_mode;
+}
+
+/**
+ * @brief Set the fraction of the particles which may change their cell before the
+ * spatial hash is rebuilt instead of moving single particles.
+ *
+ * @param fraction The fraction between 0 and 1, 0 always rebuilds.
+ */
+void PhysicsEngine::set_spatial_hash_rebuild_fraction(float fraction)
+{
+    assert(fraction >= 0.0f && fraction <= 1.0f);
+    spatial_hash_rebuild_fraction = fraction;
+    reset_broad_phase();
+}
+
+/**
+ * @returns The fraction of the particles which may change their cell before the spatial hash is rebuilt.
+ */
+float PhysicsEngine::get_spatial_hash_rebuild_fraction() const
+{
+    return spatial_hash_rebuild_fraction;
+}
+
+/**
+ * @brief Replace the broad phase by an empty one with the current settings.
+ * The self collisions build it and the neighbor lists from scratch.
+ */
+void PhysicsEngine::reset_broad_phase()
+{
+    // Each hash map cell has one point in the default cloth state. The cells
+    // grow with the skin, so all candidates are found in the neighboring cells.
+    collision_spacing = std::max(mean_rest_distance, (2.0f + neighbor_skin) * particle_radius);
+
+    switch (broad_phase_type)
+    {
+    case BroadPhaseType::SPATIAL_HASH:
+    {
+        auto spatial_hash = std::make_unique<SpatialHashStructure>(collision_spacing, 20 * particles.size(), spatial_hash_mode);
+        spatial_hash->set_rebuild_fraction(spatial_hash_rebuild_fraction);
+        broad_phase = std::move(spatial_hash);
+        break;
+    }
+    case BroadPhaseType::DENSE_GRID:
+        broad_phase = std::make_unique<DenseGrid>(collision_spacing);
+        break;
+    case BroadPhaseType::SWEEP_AND_PRUNE:
+        broad_phase = std::make_unique<SweepAndPrune>();
+        break;
+    }
+    broad_phase->set_simd_level(simd_level);
+    // The constructor builds the broad phase before its thread pool.
+    if (thread_pool)
+        broad_phase->distribute(particles.size(), *thread_pool);
+    neighbor_reference_x.clear();
+}
+
+/**
+ * @brief Back the pages of the large buffers from the threads of the pool, before the
+ * first update uses them, and place each share on the NUMA node of the thread working
+ * on it. Called whenever the thread pool is created.
+ */
+void PhysicsEngine::distribute_buffers()
+{
+    particles.distribute(*thread_pool);
+    for (huge_page_vector<unsigned int> *array : {&spring_batch_v1, &spring_batch_v2})
+        distribute_pages(*array, *thread_pool);
+    for (huge_page_vector<float> *array : {&spring_batch_rest_distance, &spring_batch_share1, &spring_batch_share2})
+        distribute_pages(*array, *thread_pool);
+
+    // Only the Jacobi solver uses the spring corrections, they are written before being read.
+    if (solver == ConstraintSolver::JACOBI)
+    {
+        for (huge_page_vector<float> *array : {&spring_correction_x, &spring_correction_y, &spring_correction_z})
+        {
+            array->resize(cloth->get_unique_springs_ref().size());
+            distribute_pages(*array, *thread_pool);
+        }
     }
+    broad_phase->distribute(particles.size(), *thread_pool);
+}
+
+/**
+ * @brief Select how the self collision finds the particles close to each other.
+ * All broad phases find the same pairs but in a different order. The collisions
+ * are solved in place, so the order changes the trajectories: the results are
+ * deterministic for each broad phase but not identical across them. Which one is
+ * fastest depends on the size and shape of the cloth.
+ *
+ * @param type The broad phase.
+ */
+void PhysicsEngine::set_broad_phase(BroadPhaseType type)
+{
+    broad_phase_type = type;
+    reset_broad_phase();
+}
+
+/**
+ * @returns How the self collision finds the particles close to each other.
+ */
+BroadPhaseType PhysicsEngine::get_broad_phase() const
+{
+    return broad_phase_type;
+}
+
+/**
+ * @returns The occupancy of the spatial hash after its last build,
+ * all zero if another broad phase is used.
+ */
+SpatialHashStatistics PhysicsEngine::get_spatial_hash_statistics() const
+{
+    if (auto spatial_hash = dynamic_cast<const SpatialHashStructure *>(broad_phase.get()))
+        return spatial_hash->get_statistics();
+    return {};
+}
+
+/**
+ * @returns How often the self collision neighbor lists were built.
+ */
+unsigned long long PhysicsEngine::get_neighbor_list_rebuilds() const
+{
+    return neighbor_list_rebuilds;
+}
+
+/**
+ * @brief Set the instruction set used by the vectorized solver and the self collision distance tests.
+ * Levels not supported by the CPU fall back to the widest supported one.
+ *
+ * @param level The instruction set.
+ */
+void PhysicsEngine::set_simd_level(SimdLevel level)
+{
+    simd_level = std::min(level, detect_simd_level());
+    distance_kernel = get_distance_kernel(simd_level);
+    broad_phase->set_simd_level(simd_level);
+}
+
+/**
+ * @returns The instruction set used by the vectorized solver.
+ */
+SimdLevel PhysicsEngine::get_simd_level() const
+{
+    return simd_level;
+}
+
+/**
+ * @brief Set the number of threads used by the parallel phases.
+ *
+ * @param thread_count The number of threads, including the calling thread.
+ */
+void PhysicsEngine::set_thread_count(unsigned int thread_count)
+{
+    thread_pool = std::make_unique<ThreadPool>(thread_count, thread_affinity);
+    distribute_buffers();
+}
+
+/**
+ * @returns The number of threads used by the parallel phases.
+ */
+unsigned int PhysicsEngine::get_thread_count() const
+{
+    return thread_pool->get_thread_count();
+}
+
+/**
+ * @brief Pin the worker threads to the given CPUs.
+ * Worker i runs on affinity[i % affinity.size()], worker 0 being the calling thread,
+ * which is not pinned. An empty list lets the operating system schedule the workers.
+ *
+ * @param affinity The CPU indices.
+ */
+void PhysicsEngine::set_thread_affinity(const std::vector<int> &affinity)
+{
+    thread_affinity = affinity;
+    thread_pool = std::make_unique<ThreadPool>(thread_pool->get_thread_count(), thread_affinity);
+    distribute_buffers();
+}
+
+/**
+ * @param paused If the simulation is paused.
+ *
+ * @brief Parks the workers while the simulation is paused, so they do not spin.
+ * The time spent paused is not simulated.
+ */
+void PhysicsEngine::set_paused(bool paused)
+{
+    thread_pool->set_parked(paused);
+    if (!paused)
+        last_update = {};
+}
+
+/**
+ * @returns The thread pool executing the parallel phases.
+ */
+ThreadPool &PhysicsEngine::get_thread_pool()
+{
+    return *thread_pool;
+}
+
+/**
+ * @returns The time per frame spent in the phases of update(). The statistics may be
+ * read while another thread updates the engine.
+ */
+const PhaseProfiler &PhysicsEngine::get_profiler() const
+{
+    return profiler;
+}
+
+/**
+ * @returns The profiler of update(), e.g. to clear it after the settings changed.
+ * Only to be used by the thread updating the engine.
+ */
+PhaseProfiler &PhysicsEngine::get_profiler()
+{
+    return profiler;
+}
+
+/**
+ * @brief Internal logic to update the physics engine
+ * In this function, the physics engine is updated by a single step. This function is called by the update function.
+ * Here, the physics engine updates the position of the cloth vertices based on the velocity and gravity.
+ * Afterwards, the physics engine applies constraints to the cloth vertices to simulate the cloth's behavior.
+ * The solver, the self collision and the mount are fixed at compile time, disabled phases
+ * are not part of the instantiation.
+ *
+ * @tparam Solver The method used to solve the distance constraints.
+ * @tparam SelfCollision If the particles collide with each other.
+ * @tparam Pinned If any particle is pinned.
+ * @param step_time The simulated time of this substep.
+ */
+template <ConstraintSolver Solver, bool SelfCollision, bool Pinned>
+void PhysicsEngine::update_step(float step_time)
+{
+    // Simulation Position Update
+    integrate<Pinned>(step_time);
 
     // Simulation Constraints
 
     // Constraint: Distance constraint
     // The distance constraint is a simple spring force between each pair of connected vertices.
     // It allows the cloth to stretch and compress, but not to bend.
-    const std::vector<float> &rest_distance = cloth->get_rest_distance_ref();
-    const std::vector<float> &mass = cloth->get_mass_ref();
+    solve_distance_constraints<Solver>();
 
-    const auto &springs = cloth->get_unique_springs_ref();
-    for (size_t i = 0; i < springs.size(); i++)
+    // Constraint: Self collission
+    if constexpr (SelfCollision)
+        solve_self_collisions();
+
+    // Update the velocity of each vertex by comparing the new position with the old position.
+    update_velocities(step_time);
+}
+
+/**
+ * @brief Simulate one substep, checking the settings in every phase.
+ * Computes the same as the specialized substep, to compare them.
+ *
+ * @param step_time The simulated time of this substep.
+ */
+void PhysicsEngine::update_step_generic(float step_time)
+{
+    integrate<true>(step_time);
+
+    switch (solver)
     {
-        // Get vertices of the edge.
-        const auto edge = springs[i];
-        unsigned int v1 = edge.data[0];
-        unsigned int v2 = edge.data[1];
-
-        vec3 x1 = vertex_positions[v1];
-        vec3 x2 = vertex_positions[v2];
-        float mass1 = mass[v1];
-        float mass2 = mass[v2];
-
-        // Determine direction vector of spring and
-        // set its length to the offset from the rest distance.
-        vec3 delta = x2 - x1;
-        float length_v = length(delta);
-        delta /= length_v;
-        delta *= (length_v - rest_distance[i]);
-
-        vec3 delta_x1 = delta;
-        vec3 delta_x2 = delta * -1.0f;
-
-        // Distribute the offset to both vertices based on their weight.
-        delta_x1 *= mass2 / (mass1 + mass2);
-        delta_x2 *= mass1 / (mass1 + mass2);
-
-        bool v1_fixed;
-        bool v2_fixed;
-        if ((v1_fixed = is_fixed(size, v1)))
+    case ConstraintSolver::GAUSS_SEIDEL:
+        solve_distance_constraints<ConstraintSolver::GAUSS_SEIDEL>();
+        break;
+    case ConstraintSolver::GRAPH_COLORED:
+        solve_distance_constraints<ConstraintSolver::GRAPH_COLORED>();
+        break;
+    case ConstraintSolver::JACOBI:
+        solve_distance_constraints<ConstraintSolver::JACOBI>();
+        break;
+    case ConstraintSolver::VECTORIZED:
+        solve_distance_constraints<ConstraintSolver::VECTORIZED>();
+        break;
+    }
+
+    if (self_collision)
+        solve_self_collisions();
+
+    update_velocities(step_time);
+}
+
+/**
+ * @returns The instantiation of the substep for the given solver and settings.
+ *
+ * @tparam Solver The method used to solve the distance constraints.
+ * @param self_collision If the particles collide with each other.
+ * @param pinned If any particle is pinned.
+ */
+template <ConstraintSolver Solver>
+PhysicsEngine::StepFunction PhysicsEngine::select_step(bool self_collision, bool pinned)
+{
+    if (self_collision)
+        return pinned ? &PhysicsEngine::update_step<Solver, true, true> : &PhysicsEngine::update_step<Solver, true, false>;
+    return pinned ? &PhysicsEngine::update_step<Solver, false, true> : &PhysicsEngine::update_step<Solver, false, false>;
+}
+
+/**
+ * @brief Point the step function to the substep compiled for the current solver,
+ * self collision setting and mount. Called whenever one of them changes.
+ */
+void PhysicsEngine::select_update_step()
+{
+    bool pinned = get_pinned_count() > 0;
+    switch (solver)
+    {
+    case ConstraintSolver::GAUSS_SEIDEL:
+        step_function = select_step<ConstraintSolver::GAUSS_SEIDEL>(self_collision, pinned);
+        break;
+    case ConstraintSolver::GRAPH_COLORED:
+        step_function = select_step<ConstraintSolver::GRAPH_COLORED>(self_collision, pinned);
+        break;
+    case ConstraintSolver::JACOBI:
+        step_function = select_step<ConstraintSolver::JACOBI>(self_collision, pinned);
+        break;
+    case ConstraintSolver::VECTORIZED:
+        step_function = select_step<ConstraintSolver::VECTORIZED>(self_collision, pinned);
+        break;
+    }
+}
+
+/**
+ * @brief For each particle in our system, determine our new velocity
+ * and update the position accordingly.
+ *
+ * @tparam Pinned If any particle is pinned. Otherwise every particle is accelerated.
+ * @param step_time The simulated time of this substep.
+ */
+template <bool Pinned>
+void PhysicsEngine::integrate(float step_time)
+{
+    AllocationScope allocation_scope(AllocationRegion::INTEGRATION);
+    ProfileScope profile_scope(&profiler, ProfilePhase::PROFILE_INTEGRATION);
+    thread_pool->parallel_for(0, particles.size(), [&](size_t begin, size_t end)
+                              {
+        // Work on raw pointers, so the compiler knows the arrays do not alias
+        // and can vectorize the loop over the particles.
+        float *__restrict x = particles.x.data();
+        float *__restrict y = particles.y.data();
+        float *__restrict z = particles.z.data();
+        float *__restrict old_x = particles.old_x.data();
+        float *__restrict old_y = particles.old_y.data();
+        float *__restrict old_z = particles.old_z.data();
+        float *__restrict velocity_x = particles.velocity_x.data();
+        float *__restrict velocity_y = particles.velocity_y.data();
+        float *__restrict velocity_z = particles.velocity_z.data();
+        const float *__restrict inverse_mass = particles.inverse_mass.data();
+
+        for (size_t i = begin; i < end; i++)
         {
-            delta_x1 *= 0.0f;
-            delta_x2 = delta * -1.0f;
-        }
-        if ((v2_fixed = is_fixed(size, v2)))
+            // Pinned particles are not accelerated. Their velocity stays 0,
+            // so they keep their position.
+            float is_free = !Pinned || inverse_mass[i] > 0.0f ? 1.0f : 0.0f;
+
+            // reduce velocity by resistance to guarantee a steady state.
+            // Also acts as air resistance.
+            // Afterwards add gravity to velocity.
+            velocity_x[i] += (gravity.entries[0] * step_time - velocity_x[i] * 0.8f * step_time) * is_free;
+            velocity_y[i] += (gravity.entries[1] * step_time - velocity_y[i] * 0.8f * step_time) * is_free;
+            velocity_z[i] += (gravity.entries[2] * step_time - velocity_z[i] * 0.8f * step_time) * is_free;
+
+            // save old position
+            old_x[i] = x[i];
+            old_y[i] = y[i];
+            old_z[i] = z[i];
+
+            // update vertex position
+            x[i] += velocity_x[i] * step_time;
+            y[i] += velocity_y[i] * step_time;
+            z[i] += velocity_z[i] * step_time;
+        } }, 4096);
+}
+
+/**
+ * @brief Push particles apart which are closer than twice the particle radius.
+ * Every pair of the neighbor list is tested once.
+ * If they are too close to each other, push them apart.
+ * The neighbor list is solved in parallel, first the even slabs, then the odd ones.
+ * Without skin, the list is built from the broad phase in every substep.
+ */
+void PhysicsEngine::solve_self_collisions()
+{
+    AllocationScope allocation_scope(AllocationRegion::COLLISION);
+    ProfileScope profile_scope(&profiler, ProfilePhase::PROFILE_COLLISION);
+    if (neighbor_skin == 0.0f || neighbor_lists_outdated())
+        build_neighbor_lists();
+
+    size_t slab_count = neighbor_slab_offsets.size() - 1;
+    for (size_t parity = 0; parity < 2; parity++)
+    {
+        thread_pool->parallel_for(0, (slab_count + 1 - parity) / 2, [&](size_t begin, size_t end)
+                                  {
+            for (size_t k = begin; k < end; k++)
+            {
+                size_t slab = 2 * k + parity;
+                for (unsigned int p = neighbor_slab_offsets[slab]; p < neighbor_slab_offsets[slab + 1]; p++)
+                    solve_particle_collision(neighbor_pairs[p].data[0], neighbor_pairs[p].data[1]);
+            } }, 1);
+    }
+}
+
+/**
+ * @brief Push two particles apart if they are closer than twice the particle radius.
+ *
+ * @param i The first particle.
+ * @param j The second particle, must differ from the first one.
+ */
+inline void PhysicsEngine::solve_particle_collision(unsigned int i, unsigned int j)
+{
+    float *x = particles.x.data();
+    float *y = particles.y.data();
+    float *z = particles.z.data();
+    const float *inverse_mass = particles.inverse_mass.data();
+
+    float local_x = x[i] - x[j];
+    float local_y = y[i] - y[j];
+    float local_z = z[i] - z[j];
+    float length_squared = local_x * local_x + local_y * local_y + local_z * local_z;
+    if (length_squared > 4 * particle_radius * particle_radius)
+        return;
+    float local_length = std::sqrt(length_squared);
+
+    // particles are too close!
+    // push them apart along the normalized connection,
+    // distributed based on their weight.
+    float weight_sum = inverse_mass[i] + inverse_mass[j];
+    if (weight_sum == 0.0f)
+        return;
+    float adjustment = (2.0f * particle_radius - local_length) / (local_length * weight_sum);
+    float adjustment1 = adjustment * inverse_mass[i];
+    float adjustment2 = adjustment * inverse_mass[j];
+
+    x[i] += local_x * adjustment1;
+    y[i] += local_y * adjustment1;
+    z[i] += local_z * adjustment1;
+    x[j] -= local_x * adjustment2;
+    y[j] -= local_y * adjustment2;
+    z[j] -= local_z * adjustment2;
+}
+
+/**
+ * @returns If the neighbor lists have to be rebuilt, because they were never
+ * built or a particle moved more than half the skin since.
+ */
+bool PhysicsEngine::neighbor_lists_outdated()
+{
+    if (neighbor_reference_x.size() != particles.size())
+        return true;
+
+    float half_skin = 0.5f * neighbor_skin * particle_radius;
+    float max_distance_squared = half_skin * half_skin;
+    std::atomic<bool> outdated(false);
+
+    thread_pool->parallel_for(0, particles.size(), [&](size_t begin, size_t end)
+                              {
+        const float *__restrict x = particles.x.data();
+        const float *__restrict y = particles.y.data();
+        const float *__restrict z = particles.z.data();
+        const float *__restrict reference_x = neighbor_reference_x.data();
+        const float *__restrict reference_y = neighbor_reference_y.data();
+        const float *__restrict reference_z = neighbor_reference_z.data();
+
+        bool moved = false;
+        for (size_t i = begin; i < end; i++)
         {
-            delta_x1 = delta;
-            delta_x2 *= 0.0f;
+            float delta_x = x[i] - reference_x[i];
+            float delta_y = y[i] - reference_y[i];
+            float delta_z = z[i] - reference_z[i];
+            moved |= delta_x * delta_x + delta_y * delta_y + delta_z * delta_z > max_distance_squared;
         }
-        if (v1_fixed && v2_fixed)
+        if (moved)
+            outdated.store(true, std::memory_order_relaxed); }, 4096);
+
+    return outdated.load();
+}
+
+/**
+ * @brief Collect the pairs of particles within the cutoff from the broad phase
+ * and sort them into slabs with a counting sort.
+ * The buffers keep their capacity, so rebuilding rarely allocates.
+ */
+void PhysicsEngine::build_neighbor_lists()
+{
+    {
+        AllocationScope allocation_scope(AllocationRegion::BROAD_PHASE);
+        ProfileScope profile_scope(&profiler, ProfilePhase::PROFILE_BROAD_PHASE);
+        broad_phase->update(particles, *thread_pool);
+    }
+
+    float cutoff = (2.0f + neighbor_skin) * particle_radius;
+    unsorted_neighbor_pairs.clear();
+    broad_phase->collect_pairs(particles, cutoff, unsorted_neighbor_pairs);
+
+    // Drop the pairs of neighbors in the mesh once per build, instead of testing them every substep.
+    if (!collision_exclusions.empty())
+    {
+        auto excluded = [&](const RealVector<unsigned int, 2> &pair)
+        { return is_collision_excluded(pair.data[0], pair.data[1]); };
+        unsorted_neighbor_pairs.erase(std::remove_if(unsorted_neighbor_pairs.begin(), unsorted_neighbor_pairs.end(), excluded),
+                                      unsorted_neighbor_pairs.end());
+    }
+
+    // The particles of a pair are at most the cutoff apart, so they are in the same or
+    // adjacent slabs. A pair is sorted into the slab of its particle with the smaller x,
+    // so it only moves particles of this and the next slab.
+    particle_slabs.resize(particles.size());
+    thread_pool->parallel_for(0, particles.size(), [&](size_t begin, size_t end)
+                              {
+        for (size_t i = begin; i < end; i++)
+            particle_slabs[i] = (int)std::floor(particles.x[i] / collision_spacing) >> 1; }, 4096);
+
+    neighbor_pair_slabs.resize(unsorted_neighbor_pairs.size());
+    int min_slab = 0;
+    int max_slab = 0;
+    for (size_t p = 0; p < unsorted_neighbor_pairs.size(); p++)
+    {
+        int slab = std::min(particle_slabs[unsorted_neighbor_pairs[p].data[0]], particle_slabs[unsorted_neighbor_pairs[p].data[1]]);
+        min_slab = p == 0 ? slab : std::min(min_slab, slab);
+        max_slab = p == 0 ? slab : std::max(max_slab, slab);
+        neighbor_pair_slabs[p] = slab;
+    }
+
+    // Count the pairs per slab and turn the counts into offsets.
+    neighbor_slab_offsets.assign(max_slab - min_slab + 2, 0);
+    for (int slab : neighbor_pair_slabs)
+        neighbor_slab_offsets[slab - min_slab + 1]++;
+    for (size_t s = 1; s < neighbor_slab_offsets.size(); s++)
+        neighbor_slab_offsets[s] += neighbor_slab_offsets[s - 1];
+
+    neighbor_pairs.resize(unsorted_neighbor_pairs.size());
+    for (size_t p = 0; p < unsorted_neighbor_pairs.size(); p++)
+        neighbor_pairs[neighbor_slab_offsets[neighbor_pair_slabs[p] - min_slab]++] = unsorted_neighbor_pairs[p];
+
+    // Scattering advanced every offset to the start of the next slab.
+    for (size_t s = neighbor_slab_offsets.size() - 1; s > 0; s--)
+        neighbor_slab_offsets[s] = neighbor_slab_offsets[s - 1];
+    neighbor_slab_offsets[0] = 0;
+
+    neighbor_reference_x.assign(particles.x.begin(), particles.x.end());
+    neighbor_reference_y.assign(particles.y.begin(), particles.y.end());
+    neighbor_reference_z.assign(particles.z.begin(), particles.z.end());
+    neighbor_list_rebuilds++;
+}
+
+/**
+ * @brief Collect the particles within exclusion_rings triangle edges of every particle
+ * with a breadth first search over the vertex neighbors of the mesh.
+ */
+void PhysicsEngine::build_collision_exclusions()
+{
+    const std::vector<unsigned int> &neighbor_offsets = cloth->get_vertex_neighbor_offsets_ref();
+    const std::vector<unsigned int> &neighbors = cloth->get_vertex_neighbors_ref();
+    size_t size = particles.size();
+
+    collision_exclusion_offsets.assign(size + 1, 0);
+    collision_exclusions.clear();
+    if (exclusion_rings == 0)
+        return;
+
+    // The particle whose search last reached a vertex, so the marks never have to be reset.
+    std::vector<unsigned int> visited(size, ~0u);
+    std::vector<unsigned int> ring, next_ring;
+    for (unsigned int i = 0; i < size; i++)
+    {
+        size_t first = collision_exclusions.size();
+        visited[i] = i;
+        ring.assign(1, i);
+        for (unsigned int r = 0; r < exclusion_rings && !ring.empty(); r++)
         {
-            delta_x1 *= 0.0f;
+            next_ring.clear();
+            for (unsigned int v : ring)
+            {
+                for (unsigned int n = neighbor_offsets[v]; n < neighbor_offsets[v + 1]; n++)
+                {
+                    unsigned int j = neighbors[n];
+                    if (visited[j] == i)
+                        continue;
+                    visited[j] = i;
+                    next_ring.push_back(j);
+                    // Each pair is stored once, with its smaller particle.
+                    if (j > i)
+                        collision_exclusions.push_back(j);
+                }
+            }
+            ring.swap(next_ring);
         }
+        std::sort(collision_exclusions.begin() + first, collision_exclusions.end());
+        collision_exclusion_offsets[i + 1] = collision_exclusions.size();
+    }
+}
 
-        vertex_positions[v1] += delta_x1;
-        vertex_positions[v2] += delta_x2;
+/**
+ * @returns If two particles are too close in the mesh to collide with each other.
+ *
+ * @param i The first particle.
+ * @param j The second particle.
+ */
+inline bool PhysicsEngine::is_collision_excluded(unsigned int i, unsigned int j) const
+{
+    unsigned int first = std::min(i, j);
+    unsigned int second = std::max(i, j);
+    // A handful of entries per particle, a linear scan beats a binary search.
+    for (unsigned int e = collision_exclusion_offsets[first]; e < collision_exclusion_offsets[first + 1]; e++)
+    {
+        if (collision_exclusions[e] >= second)
+            return collision_exclusions[e] == second;
     }
+    return false;
+}
 
-    // Constraint: Self collission
-    // iterate over vertices
-    // iterate over neighboring cells
-    // iterate over vertices in that cell
-    // if they are too close to each other -> push them apart
-    float particle_radius = rest_distance[0] / 3.f;
+/**
+ * @brief Derive the velocity of each particle from its displacement in this substep.
+ *
+ * @param step_time The simulated time of this substep.
+ */
+void PhysicsEngine::update_velocities(float step_time)
+{
+    AllocationScope allocation_scope(AllocationRegion::VELOCITIES);
+    ProfileScope profile_scope(&profiler, ProfilePhase::PROFILE_VELOCITIES);
+    float inverse_step_time = 1.0f / step_time;
+
+    thread_pool->parallel_for(0, particles.size(), [&](size_t begin, size_t end)
+                              {
+        const float *__restrict x = particles.x.data();
+        const float *__restrict y = particles.y.data();
+        const float *__restrict z = particles.z.data();
+        const float *__restrict old_x = particles.old_x.data();
+        const float *__restrict old_y = particles.old_y.data();
+        const float *__restrict old_z = particles.old_z.data();
+        float *__restrict velocity_x = particles.velocity_x.data();
+        float *__restrict velocity_y = particles.velocity_y.data();
+        float *__restrict velocity_z = particles.velocity_z.data();
+
+        for (size_t i = begin; i < end; i++)
+        {
+            velocity_x[i] = (x[i] - old_x[i]) * inverse_step_time;
+            velocity_y[i] = (y[i] - old_y[i]) * inverse_step_time;
+            velocity_z[i] = (z[i] - old_z[i]) * inverse_step_time;
+        } }, 4096);
+}
+
+/**
+ * @brief Solve all distance constraints once with the given solver.
+ *
+ * @tparam Solver The method used to solve the distance constraints.
+ */
+template <ConstraintSolver Solver>
+void PhysicsEngine::solve_distance_constraints()
+{
+    AllocationScope allocation_scope(AllocationRegion::SPRINGS);
+    ProfileScope profile_scope(&profiler, ProfilePhase::PROFILE_SPRINGS);
+    if constexpr (Solver == ConstraintSolver::JACOBI)
+    {
+        solve_distance_constraints_jacobi();
+        return;
+    }
+    if constexpr (Solver == ConstraintSolver::VECTORIZED)
+    {
+        solve_distance_constraints_vectorized();
+        return;
+    }
 
-    for (size_t i = 0; i < vertex_positions.size(); i++)
+    for (int iteration = 0; iteration < solver_iterations; iteration++)
     {
-        auto &vertex_pos = vertex_positions[i];
-        auto neighbor_cells = structure.compute_neighbor_cells(vertex_pos);
-        for (int neighbor_cell : neighbor_cells)
+        if constexpr (Solver == ConstraintSolver::GRAPH_COLORED)
+        {
+            // Springs of one color do not share vertices, so their
+            // in place updates can not conflict.
+            for (const std::vector<unsigned int> &color : cloth->get_spring_colors_ref())
+            {
+                thread_pool->parallel_for(0, color.size(), [&](size_t begin, size_t end)
+                                          {
+                    for (size_t i = begin; i < end; i++)
+                        solve_distance_constraint(color[i]); });
+            }
+        }
+        else
         {
-            auto [first, last] = structure.get_particle_range_in_cell(neighbor_cell);
-            for (auto j = first; j < last; j++)
+            for (size_t i = 0; i < cloth->get_unique_springs_ref().size(); i++)
             {
-                auto particle_index = structure.get_particles_arr()[j];
-                auto &particle_pos = vertex_positions[particle_index];
+                solve_distance_constraint(i);
+            }
+        }
+    }
+}
 
-                auto local_particle_pos = vertex_pos - particle_pos;
-                auto local_length = length(local_particle_pos);
-                if (local_length > 2 * particle_radius)
-                    continue;
-                if (i == particle_index)
-                    continue;
+/**
+ * @brief Solve all distance constraints with Chebyshev accelerated Jacobi iterations.
+ * Each iteration first computes the correction of every spring from the current positions
+ * and then moves every vertex by the average correction of its springs. Both passes
+ * are free of write conflicts and run in parallel. Averaging makes an iteration much
+ * weaker than an in place one, so every constraint iteration runs jacobi_sweeps of them.
+ * The Chebyshev semi-iterative method extrapolates the Jacobi result using the positions
+ * of the previous iteration (Wang 2015, "A Chebyshev Semi-Iterative Approach for
+ * Accelerating Projective and Position-based Dynamics").
+ */
+void PhysicsEngine::solve_distance_constraints_jacobi()
+{
+    size_t size = particles.size();
+    const auto &springs = cloth->get_unique_springs_ref();
+    const huge_page_vector<float> &rest_distance = cloth->get_rest_distance_ref();
+    const std::vector<unsigned int> &offsets = cloth->get_vertex_spring_offsets_ref();
+    const std::vector<unsigned int> &vertex_springs = cloth->get_vertex_springs_ref();
 
-                // particles are too close!
-                // do some computation to push them apart!
+    spring_correction_x.resize(springs.size());
+    spring_correction_y.resize(springs.size());
+    spring_correction_z.resize(springs.size());
+    previous_x.resize(size);
+    previous_y.resize(size);
+    previous_z.resize(size);
 
-                // normalize
-                local_particle_pos /= local_length;
+    float *x = particles.x.data();
+    float *y = particles.y.data();
+    float *z = particles.z.data();
+    float *correction_x = spring_correction_x.data();
+    float *correction_y = spring_correction_y.data();
+    float *correction_z = spring_correction_z.data();
 
-                float adjustment = 2.0f * particle_radius - local_length;
+    float rho_squared = chebyshev_rho * chebyshev_rho;
+    float omega = 1.0f;
+    // Iterations since the Chebyshev sequence was last restarted.
+    int accelerated_iterations = 0;
+    float previous_residual = std::numeric_limits<float>::infinity();
+    int sweeps = solver_iterations * jacobi_sweeps;
+    for (int iteration = 0; iteration < sweeps; iteration++)
+    {
+        // Largest deviation of a spring from its rest distance, the maximum does not
+        // depend on how the springs are split between the threads.
+        std::atomic<float> residual(0.0f);
 
-                if (!is_fixed(size, i))
-                    vertex_pos += (local_particle_pos * (0.5f * adjustment));
-                if (!is_fixed(size, particle_index))
-                    particle_pos -= (local_particle_pos * (0.5f * adjustment));
+        // Offset of every spring from its rest distance, pointing from the first to the second vertex.
+        thread_pool->parallel_for(0, springs.size(), [&](size_t begin, size_t end)
+                                  {
+            float chunk_residual = 0.0f;
+            for (size_t i = begin; i < end; i++)
+            {
+                unsigned int v1 = springs[i].data[0];
+                unsigned int v2 = springs[i].data[1];
+                float delta_x = x[v2] - x[v1];
+                float delta_y = y[v2] - y[v1];
+                float delta_z = z[v2] - z[v1];
+                float length_v = std::sqrt(delta_x * delta_x + delta_y * delta_y + delta_z * delta_z);
+                float offset = (length_v - rest_distance[i]) / length_v;
+                correction_x[i] = delta_x * offset;
+                correction_y[i] = delta_y * offset;
+                correction_z[i] = delta_z * offset;
+                chunk_residual = std::max(chunk_residual, std::abs(length_v - rest_distance[i]));
             }
+            float current = residual.load(std::memory_order_relaxed);
+            while (chunk_residual > current && !residual.compare_exchange_weak(current, chunk_residual, std::memory_order_relaxed))
+                ; });
+
+        // Chebyshev weights. The first iteration is a plain Jacobi step. The extrapolation
+        // overshoots if rho overestimates the convergence of the nonlinear constraints, so
+        // the sequence restarts with a plain step whenever the residual grew. The last
+        // iteration is always a plain step, the overshoot of an extrapolation would
+        // otherwise end up in the velocities and grow from substep to substep.
+        float current_residual = residual.load();
+        if (!(current_residual < previous_residual))
+            accelerated_iterations = 0;
+        previous_residual = current_residual;
+        if (accelerated_iterations == 0 || iteration == sweeps - 1)
+            omega = 1.0f;
+        else if (accelerated_iterations == 1)
+            omega = 2.0f / (2.0f - rho_squared);
+        else
+            omega = 4.0f / (4.0f - rho_squared * omega);
+        accelerated_iterations++;
+
+        // Move every vertex by the average correction of its springs.
+        thread_pool->parallel_for(0, size, [&](size_t begin, size_t end)
+                                  {
+            for (size_t v = begin; v < end; v++)
+            {
+                unsigned int first = offsets[v];
+                unsigned int last = offsets[v + 1];
+                float sum_x = 0.0f;
+                float sum_y = 0.0f;
+                float sum_z = 0.0f;
+                for (unsigned int k = first; k < last; k++)
+                {
+                    unsigned int spring = vertex_springs[k];
+                    // The first vertex moves along the spring, the second one against it.
+                    float share = v == springs[spring].data[0] ? spring_share1[spring] : -spring_share2[spring];
+                    sum_x += correction_x[spring] * share;
+                    sum_y += correction_y[spring] * share;
+                    sum_z += correction_z[spring] * share;
+                }
+
+                float count = std::max(last - first, 1u);
+                float jacobi_x = x[v] + sum_x / count;
+                float jacobi_y = y[v] + sum_y / count;
+                float jacobi_z = z[v] + sum_z / count;
+
+                // Extrapolate from the previous iteration. In the first iteration
+                // omega is 1, so the previous positions are not used.
+                float next_x = omega * (jacobi_x - previous_x[v]) + previous_x[v];
+                float next_y = omega * (jacobi_y - previous_y[v]) + previous_y[v];
+                float next_z = omega * (jacobi_z - previous_z[v]) + previous_z[v];
+                previous_x[v] = x[v];
+                previous_y[v] = y[v];
+                previous_z[v] = z[v];
+                x[v] = next_x;
+                y[v] = next_y;
+                z[v] = next_z;
+            } });
+    }
+}
+
+/**
+ * @brief Solve all distance constraints color by color with the vectorized kernel.
+ * Springs of one color share no vertices, so every chunk of a color is a
+ * batch whose lanes can be written back without conflicts.
+ */
+void PhysicsEngine::solve_distance_constraints_vectorized()
+{
+    float *x = particles.x.data();
+    float *y = particles.y.data();
+    float *z = particles.z.data();
+
+    for (int iteration = 0; iteration < solver_iterations; iteration++)
+    {
+        for (size_t color = 0; color + 1 < spring_batch_offsets.size(); color++)
+        {
+            thread_pool->parallel_for(spring_batch_offsets[color], spring_batch_offsets[color + 1], [&](size_t begin, size_t end)
+                                      {
+                DistanceConstraintBatch batch;
+                batch.v1 = spring_batch_v1.data() + begin;
+                batch.v2 = spring_batch_v2.data() + begin;
+                batch.rest_distance = spring_batch_rest_distance.data() + begin;
+                batch.share1 = spring_batch_share1.data() + begin;
+                batch.share2 = spring_batch_share2.data() + begin;
+                batch.count = end - begin;
+                distance_kernel(x, y, z, batch); }, 1024);
         }
     }
+}
 
-    // Update the velocity of each vertex by comparing the new position with the old position.
-    for (size_t i = 0; i < vertex_positions.size(); i++)
+/**
+ * @brief Lay out the springs color by color for the vectorized solver.
+ */
+void PhysicsEngine::build_spring_batches()
+{
+    const auto &springs = cloth->get_unique_springs_ref();
+    const huge_page_vector<float> &rest_distance = cloth->get_rest_distance_ref();
+
+    spring_batch_v1.clear();
+    spring_batch_v2.clear();
+    spring_batch_rest_distance.clear();
+    spring_batch_share1.clear();
+    spring_batch_share2.clear();
+    spring_batch_offsets.assign(1, 0);
+
+    for (const std::vector<unsigned int> &color : cloth->get_spring_colors_ref())
     {
-        velocity[i] = (vertex_positions[i] - old_position[i]) / step_time;
+        for (unsigned int spring : color)
+        {
+            spring_batch_v1.push_back(springs[spring].data[0]);
+            spring_batch_v2.push_back(springs[spring].data[1]);
+            spring_batch_rest_distance.push_back(rest_distance[spring]);
+            spring_batch_share1.push_back(spring_share1[spring]);
+            spring_batch_share2.push_back(spring_share2[spring]);
+        }
+        spring_batch_offsets.push_back(spring_batch_v1.size());
     }
 }
 
 /**
- * @param size The number of vertices.
- * @param index The current vertex index.
- * @returns If the vertex is fixed.
- *
- * @brief Determines if a vertex should be fixed.
+ * @brief Pin the vertices selected by the mount by setting their inverse mass to 0.
+ * Grid mounts use the row length of the cloth, so they also work on non-square grids.
  */
-bool PhysicsEngine::is_fixed(unsigned int size, unsigned int index) const
+void PhysicsEngine::pin_vertices()
 {
-    // Constraint: top left and top right must stay in place
-    // This constraint is a simple position constraint
-    // that keeps the top left and top right vertices in place.
-    // Hence, the cloth will not fall down and we can see the
-    // effect of the other constraints.
+    unsigned int size = particles.size();
+    unsigned int num_cols = cloth->get_row_length();
+    unsigned int num_rows = size / num_cols;
+
+    // The mounts address the vertices by their place in the rows of the obj file.
     if (mount == MountingType::CORNER_VERTEX)
     {
-        return index == size - 1;
+        particles.inverse_mass[cloth->get_vertex_index(size - 1)] = 0.0f;
     }
     else if (mount == MountingType::MIDDLE_VERTEX)
     {
-        unsigned int num_cols = std::sqrt(size);
-        return index == num_cols / 2 + num_cols * num_cols / 2;
+        // The middle column of the middle row. Before the row length was known, the
+        // index was num_cols / 2 + num_cols * num_cols / 2, which on grids with an odd
+        // number of rows is (num_cols - 1) / 2 vertices right of the center, at the end of the row.
+        particles.inverse_mass[cloth->get_vertex_index(num_cols / 2 + num_cols * (num_rows / 2))] = 0.0f;
     }
     else if (mount == MountingType::TOP_ROW)
     {
-        unsigned int num_cols = std::sqrt(size);
-        return index >= size - num_cols - 1;
+        for (unsigned int i = size - num_cols; i < size; i++)
+            particles.inverse_mass[cloth->get_vertex_index(i)] = 0.0f;
+    }
+    else if (mount == MountingType::PIN_SET)
+    {
+        for (unsigned int i : cloth->get_pinned_vertices_ref())
+            particles.inverse_mass[i] = 0.0f;
     }
-    else
-        return false;
 }
 
-#ifndef __clang__
-ConcurrentPhysicsEngine::ConcurrentPhysicsEngine(ClothMesh *cloth, vec3 gravity, MountingType m)
-    : internal_engine(cloth, gravity, m)
+/**
+ * @brief Determine how the correction of every spring is split between its vertices.
+ * The offset is distributed based on the inverse masses, so a pinned vertex
+ * does not move and the other one takes the whole offset.
+ * The shares only depend on the masses, so they are computed once.
+ */
+void PhysicsEngine::compute_spring_shares()
 {
-    is_physics_computed.store(true);
-    auto worker_f = [&]()
+    const auto &springs = cloth->get_unique_springs_ref();
+    spring_share1.resize(springs.size());
+    spring_share2.resize(springs.size());
+
+    for (size_t i = 0; i < springs.size(); i++)
     {
-        while (true)
-        {
-            is_physics_computed.wait(true); // blocks until is_physics_computed turns to false
+        float weight1 = particles.inverse_mass[springs[i].data[0]];
+        float weight2 = particles.inverse_mass[springs[i].data[1]];
+        float weight_sum = weight1 + weight2;
+        // Springs between two pinned vertices are not corrected.
+        spring_share1[i] = weight_sum > 0.0f ? weight1 / weight_sum : 0.0f;
+        spring_share2[i] = weight_sum > 0.0f ? weight2 / weight_sum : 0.0f;
+    }
+}
+
+/**
+ * @brief Move both vertices of a spring such that it reaches its rest distance.
+ *
+ * @param spring The index of the spring.
+ */
+inline void PhysicsEngine::solve_distance_constraint(size_t spring)
+{
+    float *x = particles.x.data();
+    float *y = particles.y.data();
+    float *z = particles.z.data();
 
-            internal_engine.update();
+    // Get vertices of the edge.
+    const auto edge = cloth->get_unique_springs_ref()[spring];
+    unsigned int v1 = edge.data[0];
+    unsigned int v2 = edge.data[1];
 
-            is_physics_computed.store(true);
-            is_physics_computed.notify_one();
-        }
-    };
+    // Determine direction vector of spring and
+    // set its length to the offset from the rest distance.
+    float delta_x = x[v2] - x[v1];
+    float delta_y = y[v2] - y[v1];
+    float delta_z = z[v2] - z[v1];
+    float length_v = std::sqrt(delta_x * delta_x + delta_y * delta_y + delta_z * delta_z);
+    float offset = (length_v - cloth->get_rest_distance_ref()[spring]) / length_v;
+
+    // Distribute the offset to both vertices based on their weight.
+    float share1 = spring_share1[spring];
+    float share2 = spring_share2[spring];
+
+    x[v1] += delta_x * offset * share1;
+    y[v1] += delta_y * offset * share1;
+    z[v1] += delta_z * offset * share1;
+    x[v2] -= delta_x * offset * share2;
+    y[v2] -= delta_y * offset * share2;
+    z[v2] -= delta_z * offset * share2;
+}
+
+/**
+ * @brief Construct a new Concurrent Physics Engine:: Concurrent Physics Engine object
+ * The simulation runs on a worker of the engine's thread pool on a copy of the cloth,
+ * so the calling thread can keep rendering. It starts paused.
+ *
+ * @param cloth Pointer to cloth which is to be simulated
+ * @param gravity Gravitational force to be simulated
+ * @param m Determines which points of the cloth are fixed in place
+ * @param self_collision If the particles of the cloth collide with each other
+ */
+ConcurrentPhysicsEngine::ConcurrentPhysicsEngine(ClothState *cloth, vec3 gravity, MountingType m, bool self_collision)
+    : cloth(cloth), simulated_cloth(*cloth), internal_engine(&simulated_cloth, gravity, m), paused(true), stop(false)
+{
+    // Settings of the internal engine can only change before the simulation loop starts.
+    internal_engine.set_self_collision(self_collision);
 
-    worker = std::jthread(worker_f);
+    // The simulation loop occupies one worker for good, so the pool needs at least one.
+    if (internal_engine.get_thread_count() < 2)
+        internal_engine.set_thread_count(2);
+
+    internal_engine.get_thread_pool().run_async([this]()
+                                                { run(); });
 }
 
+/**
+ * @brief Destroy the Concurrent Physics Engine:: Concurrent Physics Engine object
+ * Stops the simulation loop and waits for it to finish.
+ */
+ConcurrentPhysicsEngine::~ConcurrentPhysicsEngine()
+{
+    stop.store(true);
+    paused.store(false);
+    paused.notify_all();
+    internal_engine.get_thread_pool().wait_async();
+}
+
+/**
+ * @brief Show the most recently finished frame on the cloth. Never blocks.
+ */
 void ConcurrentPhysicsEngine::update()
 {
-    is_physics_computed.store(false);
-    is_physics_computed.notify_one();
+    if (frames.update_front())
+        cloth->set_vertex_positions(frames.get_front());
+}
+
+/**
+ * @param _paused If the simulation is paused.
+ *
+ * @brief Pauses or resumes the simulation loop.
+ */
+void ConcurrentPhysicsEngine::set_paused(bool _paused)
+{
+    paused.store(_paused);
+    paused.notify_all();
 }
 
-void ConcurrentPhysicsEngine::wait()
+/**
+ * @returns The time per frame spent in the phases of the simulation on the physics thread.
+ */
+const PhaseProfiler &ConcurrentPhysicsEngine::get_profiler() const
+{
+    return internal_engine.get_profiler();
+}
+
+/**
+ * @brief The simulation loop. Simulates frames as fast as possible and publishes
+ * every finished frame, until the engine is destroyed.
+ */
+void ConcurrentPhysicsEngine::run()
 {
-    is_physics_computed.wait(false); // blocks until is_physics_computed turns to true
+    while (!stop.load())
+    {
+        if (paused.load())
+        {
+            internal_engine.set_paused(true);
+            paused.wait(true);
+            internal_engine.set_paused(false);
+            continue;
+        }
+
+        internal_engine.update();
+
+        // Assigning keeps the capacity of the back buffer, so no allocation happens.
+        std::span<const vec3> positions = simulated_cloth.get_vertex_positions();
+        frames.get_back().assign(positions.begin(), positions.end());
+        frames.publish();
+    }
 }
-#endif
@@ -1,54 +1,246 @@
 #pragma once
 
-#include "cloth_mesh.h"
+#include "cloth_state.h"
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include "algebraic_types.h"
+#include "aligned_allocator.h"
+#include "broad_phase.h"
 #include "spatial_hash_structure.h"
+#include "particle_store.h"
+#include "phase_profiler.h"
+#include "thread_pool.h"
+#include "distance_kernel.h"
+#include "triple_buffer.h"
 #include <condition_variable>
 
+// Determines which vertices of the cloth are fixed in place.
 enum MountingType
 {
-    CORNER_VERTEX = GLFW_KEY_1,
-    TOP_ROW = GLFW_KEY_2,
-    MIDDLE_VERTEX = GLFW_KEY_3,
-    UNCONSTRAINED = GLFW_KEY_4
+    CORNER_VERTEX,
+    TOP_ROW,
+    MIDDLE_VERTEX,
+    UNCONSTRAINED,
+    // The vertices of the pin set of the cloth.
+    PIN_SET
 };
 
+// Determines how the distance constraints are solved.
+enum ConstraintSolver
+{
+    // Serial in place update over all springs.
+    GAUSS_SEIDEL,
+    // In place update, springs of one color are solved in parallel.
+    GRAPH_COLORED,
+    // Corrections of all springs are computed from the same positions and
+    // averaged per vertex. Accelerated with the Chebyshev semi-iterative method.
+    JACOBI,
+    // Like GRAPH_COLORED, but each thread solves several springs per instruction.
+    VECTORIZED
+};
+
+// Largest spectral radius estimate accepted for the Chebyshev acceleration. Larger
+// estimates made the Jacobi solver diverge on the bundled meshes with 2 to 4 sweeps.
+constexpr float max_chebyshev_rho = 0.9f;
+
 class PhysicsEngine
 {
 public:
-    PhysicsEngine(ClothMesh *cloth, vec3 gravity, MountingType mount);
+    PhysicsEngine(ClothState *cloth, vec3 gravity, MountingType mount);
     void update();
+    void update(float delta_time);
+
+    size_t get_pinned_count() const;
+
+    void set_substeps(int substeps);
+    int get_substeps() const;
+
+    void set_constraint_solver(ConstraintSolver solver);
+    ConstraintSolver get_constraint_solver() const;
+
+    void set_solver_iterations(int iterations);
+    int get_solver_iterations() const;
+
+    void set_jacobi_sweeps(int sweeps);
+    int get_jacobi_sweeps() const;
+
+    void set_chebyshev_rho(float rho);
+    float get_chebyshev_rho() const;
+
+    void set_self_collision(bool enabled);
+    bool get_self_collision() const;
+
+    void set_specialized_step(bool specialized);
+    bool get_specialized_step() const;
+
+    void set_neighbor_skin(float skin);
+    float get_neighbor_skin() const;
+    unsigned long long get_neighbor_list_rebuilds() const;
+
+    void set_collision_exclusion_rings(unsigned int rings);
+    unsigned int get_collision_exclusion_rings() const;
+
+    void set_broad_phase(BroadPhaseType type);
+    BroadPhaseType get_broad_phase() const;
+
+    void set_spatial_hash_mode(SpatialHashMode mode);
+    SpatialHashMode get_spatial_hash_mode() const;
+    void set_spatial_hash_rebuild_fraction(float fraction);
+    float get_spatial_hash_rebuild_fraction() const;
+    SpatialHashStatistics get_spatial_hash_statistics() const;
+
+    void set_simd_level(SimdLevel level);
+    SimdLevel get_simd_level() const;
+
+    void set_thread_count(unsigned int thread_count);
+    unsigned int get_thread_count() const;
+    void set_thread_affinity(const std::vector<int> &affinity);
+    void set_paused(bool paused);
+    ThreadPool &get_thread_pool();
+
+    // Time per frame spent in each phase of update(), safe to query from any thread.
+    const PhaseProfiler &get_profiler() const;
+    PhaseProfiler &get_profiler();
 
 private:
-    ClothMesh *cloth;
+    ClothState *cloth;
     vec3 gravity;
     MountingType mount;
-    std::vector<vec3> velocity;
-    std::vector<vec3> old_position;
+    // Positions, velocities and inverse masses of all particles.
+    // Pinned particles have an inverse mass of 0.
+    ParticleStore particles;
     int substeps;
     float delta_time;
-    void update_step(std::vector<vec3> &vertex_positions, const SpatialHashStructure &structure);
-    bool is_fixed(unsigned int size, unsigned int index) const;
+    ConstraintSolver solver;
+    // Constraint iterations per substep.
+    int solver_iterations;
+    // Jacobi iterations per constraint iteration. A Jacobi iteration averages the
+    // corrections of all springs of a vertex, so it converges much slower than
+    // an in place iteration and needs several to reach a similar strain.
+    int jacobi_sweeps;
+    // Estimated spectral radius of the Jacobi iteration, 0 disables the acceleration.
+    float chebyshev_rho;
+    // If the particles collide with each other.
+    bool self_collision;
+    // The substep compiled for the current solver, self collision and mount, picked by
+    // select_update_step(). Without specialization, update_step_generic() decides on
+    // every phase at run time.
+    bool specialized_step;
+    typedef void (PhysicsEngine::*StepFunction)(float step_time);
+    StepFunction step_function;
+    // Executes the parallel phases. Its workers are pinned to thread_affinity.
+    std::unique_ptr<ThreadPool> thread_pool;
+    std::vector<int> thread_affinity;
+
+    // Finds the neighbor pairs of the self collision. Kept between updates so its buffers are reused.
+    std::unique_ptr<BroadPhase> broad_phase;
+    BroadPhaseType broad_phase_type;
+    // Settings of the spatial hash broad phase.
+    SpatialHashMode spatial_hash_mode;
+    float spatial_hash_rebuild_fraction;
+    // Cell size of the grid based broad phases, at least the neighbor list cutoff.
+    float collision_spacing;
+    float mean_rest_distance;
+    float particle_radius;
+
+    // Verlet neighbor list of the self collision. Contains every pair of particles
+    // closer than twice the particle radius plus the skin once, so it stays valid
+    // until a particle moved more than half the skin.
+    // The skin is given in particle radii, 0 disables the list.
+    float neighbor_skin;
+    std::vector<RealVector<unsigned int, 2>> neighbor_pairs;
+    // The pairs are sorted into slabs two collision spacings wide along the x axis. The pairs of slab s
+    // are neighbor_pairs[neighbor_slab_offsets[s]] up to neighbor_pairs[neighbor_slab_offsets[s + 1]].
+    // A pair only moves particles of its own and the next slab, so every second slab
+    // can be solved in parallel.
+    std::vector<unsigned int> neighbor_slab_offsets;
+    // Scratch buffers to sort the pairs into slabs.
+    std::vector<RealVector<unsigned int, 2>> unsorted_neighbor_pairs;
+    std::vector<int> neighbor_pair_slabs;
+    std::vector<int> particle_slabs;
+    // Particles at most exclusion_rings triangle edges apart never collide with each other,
+    // they are kept apart by the springs. The excluded partners of particle i with a larger
+    // index are collision_exclusions[collision_exclusion_offsets[i]] up to
+    // collision_exclusions[collision_exclusion_offsets[i + 1]] (exclusive), sorted.
+    unsigned int exclusion_rings;
+    std::vector<unsigned int> collision_exclusion_offsets;
+    std::vector<unsigned int> collision_exclusions;
+    // Positions at the time the lists were built.
+    aligned_vector<float> neighbor_reference_x, neighbor_reference_y, neighbor_reference_z;
+    unsigned long long neighbor_list_rebuilds;
+
+    // Share of the correction each vertex of a spring takes, derived from the inverse masses.
+    aligned_vector<float> spring_share1, spring_share2;
+
+    // Scratch buffers of the Jacobi solver. Corrections are stored per spring,
+    // the positions of the previous iteration per vertex.
+    huge_page_vector<float> spring_correction_x, spring_correction_y, spring_correction_z;
+    aligned_vector<float> previous_x, previous_y, previous_z;
+
+    // Springs ordered by color with precomputed shares, for the vectorized solver.
+    // The springs of color c are in [spring_batch_offsets[c], spring_batch_offsets[c + 1]).
+    huge_page_vector<unsigned int> spring_batch_v1, spring_batch_v2;
+    huge_page_vector<float> spring_batch_rest_distance, spring_batch_share1, spring_batch_share2;
+    std::vector<size_t> spring_batch_offsets;
+    SimdLevel simd_level;
+    DistanceKernel distance_kernel;
+    PhaseProfiler profiler;
+
+    template <ConstraintSolver Solver, bool SelfCollision, bool Pinned>
+    void update_step(float step_time);
+    void update_step_generic(float step_time);
+    void select_update_step();
+    template <ConstraintSolver Solver>
+    static StepFunction select_step(bool self_collision, bool pinned);
+    template <bool Pinned>
+    void integrate(float step_time);
+    template <ConstraintSolver Solver>
+    void solve_distance_constraints();
+    void solve_self_collisions();
+    void solve_particle_collision(unsigned int i, unsigned int j);
+    bool neighbor_lists_outdated();
+    void build_neighbor_lists();
+    void build_collision_exclusions();
+    bool is_collision_excluded(unsigned int i, unsigned int j) const;
+    void reset_broad_phase();
+    void distribute_buffers();
+    void update_velocities(float step_time);
+    void solve_distance_constraint(size_t spring);
+    void solve_distance_constraints_jacobi();
+    void solve_distance_constraints_vectorized();
+    void pin_vertices();
+    void compute_spring_shares();
+    void build_spring_batches();
 
     std::chrono::time_point<std::chrono::high_resolution_clock> last_update;
 
 public:
 };
 
-#ifndef __clang__
+// Runs the simulation continuously in the background, independent of the render rate.
+// Finished frames are handed to the renderer through a lock-free triple buffer.
 class ConcurrentPhysicsEngine
 {
 public:
-    ConcurrentPhysicsEngine(ClothMesh *cloth, vec3 gravity, MountingType m);
+    ConcurrentPhysicsEngine(ClothState *cloth, vec3 gravity, MountingType m, bool self_collision = true);
+    ~ConcurrentPhysicsEngine();
     void update();
-    void wait();
+    void set_paused(bool paused);
+    const PhaseProfiler &get_profiler() const;
 
 private:
+    // The cloth shown to the user, only touched by the calling thread.
+    ClothState *cloth;
+    // Copy of the cloth, only touched by the physics thread.
+    ClothState simulated_cloth;
     PhysicsEngine internal_engine;
-    std::jthread worker;
 
-    std::atomic<bool> is_physics_computed;
+    TripleBuffer<std::vector<vec3>> frames;
+    std::atomic<bool> paused;
+    std::atomic<bool> stop;
+
+    void run();
 };
-#endif
\ No newline at end of file
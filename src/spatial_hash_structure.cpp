@@ -1,24 +1,102 @@
 #include "spatial_hash_structure.h"
 #include <cassert>
+#include <algorithm>
+#include <bit>
+#include <atomic>
+#include "thread_pool.h"
+
+// Bits of the keys sorted per radix sort pass.
+static const unsigned int radix_bits = 11;
+static const unsigned int radix_size = 1u << radix_bits;
+
+// Bits per coordinate in a 64-bit cell key. Cells further than 2^20 cells
+// from the origin wrap around, which only adds candidates far apart.
+static const unsigned int cell_key_bits = 21;
+static const uint64_t cell_key_mask = (uint64_t(1) << cell_key_bits) - 1;
+static const int cell_key_offset = 1 << (cell_key_bits - 1);
 
 /**
- * @brief Construct a new Spatial Hash Structure:: Spatial Hash Structure object
+ * @brief Run a loop on the thread pool, or serially without one.
+ *
+ * @param thread_pool The threads to run the loop on, may be nullptr.
+ * @param begin First index of the loop.
+ * @param end Index after the last index of the loop.
+ * @param func Function processing the index range [chunk_begin, chunk_end).
+ * @param grain_size Minimum number of indices per chunk.
+ */
+template <typename Func>
+static void run_loop(ThreadPool *thread_pool, size_t begin, size_t end, const Func &func, size_t grain_size)
+{
+	if (thread_pool != nullptr)
+		thread_pool->parallel_for(begin, end, func, grain_size);
+	else
+		func(begin, end);
+}
+
+/**
+ * @brief Construct a new empty Spatial Hash Structure:: Spatial Hash Structure object
+ * Call rebuild() to fill it with particles.
  *
- * @param vertices The vertices to be discretized
  * @param _spacing The spacing between the cells
- * @param _table_size The size of the table
+ * @param _table_size The size of the table, not used by the compact mode
+ * @param _mode How the cells are stored
  */
-SpatialHashStructure::SpatialHashStructure(const std::vector<vec3> &vertices, float _spacing, int _table_size)
+SpatialHashStructure::SpatialHashStructure(float _spacing, unsigned int _table_size, SpatialHashMode _mode)
 {
+	assert(_table_size > 0);
+	mode = _mode;
 	table_size = _table_size + 1;
 	spacing = _spacing;
-	table.resize(table_size, 0);
-	particles.resize(vertices.size(), 0);
+	index_mask = 0;
+	rebuild_fraction = 0.1f;
+	proximity_kernel = get_proximity_kernel(detect_simd_level());
+	incremental_updates = 0;
+	full_rebuilds = 0;
+	if (mode == SpatialHashMode::SPARSE_TABLE)
+		table.resize(table_size, 0);
+	else
+		cell_starts.assign(2, 0);
+}
+
+/**
+ * @brief Construct a new Spatial Hash Structure:: Spatial Hash Structure object
+ *
+ * @param vertices The particles to be discretized
+ * @param _spacing The spacing between the cells
+ * @param _table_size The size of the table
+ */
+SpatialHashStructure::SpatialHashStructure(const ParticleStore &vertices, float _spacing, unsigned int _table_size)
+	: SpatialHashStructure(_spacing, _table_size)
+{
+	rebuild(vertices);
+}
+
+/**
+ * @brief Sort the particles into the table again, e.g. after they moved.
+ * Reuses the buffers of the previous build.
+ *
+ * @param vertices The particles to be discretized
+ */
+void SpatialHashStructure::rebuild(const ParticleStore &vertices)
+{
+	if (mode == SpatialHashMode::COMPACT)
+	{
+		rebuild_compact(vertices, nullptr);
+		return;
+	}
+
+	// Only allocates when the particle count grew.
+	particles.resize(vertices.size());
+	particle_cells.resize(vertices.size());
+	particle_coordinates.resize(vertices.size());
+	cell_coordinates.resize(vertices.size());
+	std::fill(table.begin(), table.end(), 0);
 
 	// discretize to bounding box
-	for (const vec3 &v : vertices)
+	for (size_t i = 0; i < vertices.size(); i++)
 	{
-		unsigned int h = compute_hash_index(v);
+		unsigned int h = compute_hash_index(vertices.x[i], vertices.y[i], vertices.z[i]);
+		particle_cells[i] = h;
 		table[h]++;
 	}
 
@@ -30,75 +108,778 @@ SpatialHashStructure::SpatialHashStructure(const std::vector<vec3> &vertices, fl
 		table[i] = sum;
 	}
 
-	for (size_t i = 0; i < vertices.size(); i++)
+	// Scatter backwards, so the particles of an entry are in ascending order like in the parallel build.
+	for (size_t i = vertices.size(); i-- > 0;)
 	{
-		const vec3 &v = vertices[i];
-		unsigned int h = compute_hash_index(v);
-		unsigned int index = --table[h];
+		unsigned int index = --table[particle_cells[i]];
 
 		particles[index] = i;
+		particle_coordinates[i] = compute_cell(vertices.x[i], vertices.y[i], vertices.z[i]);
+		cell_coordinates[index] = particle_coordinates[i];
 	}
+	gather_positions(vertices, nullptr);
 }
 
 /**
- * @brief Compute the hash index of a vertex
+ * @brief Sort the particles into the table again, using all threads of a pool.
+ * The particles are radix sorted by their hash, then the offsets of the table
+ * are read off the sorted hashes.
+ * The result is the same as the one of the serial build, which is used for a single thread.
  *
- * @param v The vertex to be hashed
- * @return unsigned int The hash index
+ * @param vertices The particles to be discretized
+ * @param thread_pool The threads to build the table with
  */
-unsigned int SpatialHashStructure::compute_hash_index(const vec3 &v) const
+void SpatialHashStructure::rebuild(const ParticleStore &vertices, ThreadPool &thread_pool)
 {
-	int x = std::floor(v.entries[0] / spacing);
-	int y = std::floor(v.entries[1] / spacing);
-	int z = std::floor(v.entries[2] / spacing);
-	int3 index3 = {x, y, z};
+	if (mode == SpatialHashMode::COMPACT)
+	{
+		rebuild_compact(vertices, &thread_pool);
+		return;
+	}
+	if (thread_pool.get_thread_count() == 1)
+	{
+		rebuild(vertices);
+		return;
+	}
 
-	unsigned int h = hash(index3);
+	size_t size = vertices.size();
+	particles.resize(size);
+	particle_cells.resize(size);
+	particle_coordinates.resize(size);
+	cell_coordinates.resize(size);
+	sorted_keys.resize(size);
 
-	return h;
+	// Hash every particle once.
+	thread_pool.parallel_for(0, size, [&](size_t begin, size_t end)
+							 {
+		for (size_t i = begin; i < end; i++)
+		{
+			particle_cells[i] = compute_hash_index(vertices.x[i], vertices.y[i], vertices.z[i]);
+			sorted_keys[i] = particle_cells[i];
+			particles[i] = i;
+		} }, 4096);
+
+	radix_sort(sorted_keys, sort_keys, &thread_pool);
+
+	// Table entry h starts at the first particle with a hash of at least h. Particle p
+	// fills the entries between the hash of the particle before it and its own hash,
+	// so every entry is written exactly once.
+	thread_pool.parallel_for(0, size + 1, [&](size_t begin, size_t end)
+							 {
+		for (size_t p = begin; p < end; p++)
+		{
+			unsigned int first = p == 0 ? 0 : sorted_keys[p - 1] + 1;
+			unsigned int last = p == size ? table_size - 1 : sorted_keys[p];
+			for (unsigned int h = first; h <= last; h++)
+				table[h] = p;
+
+			if (p < size)
+			{
+				unsigned int i = particles[p];
+				particle_coordinates[i] = compute_cell(vertices.x[i], vertices.y[i], vertices.z[i]);
+				cell_coordinates[p] = particle_coordinates[i];
+			}
+		} }, 4096);
+	gather_positions(vertices, &thread_pool);
 }
 
 /**
- * @brief Hashes an index
+ * @brief Stable radix sort of the keys together with the particles array, 11 bits per pass.
+ * Every pass counts the digits per chunk of particles, turns the counts into offsets
+ * and scatters the chunks in parallel. Passes over bits which are the same for all keys
+ * are skipped. The result does not depend on the number of threads.
  *
- * @param index index to be hashed
- * @return unsigned int hashed index
+ * @param keys The key of every entry of the particles array, sorted afterwards.
+ * @param scratch Buffer for the keys of every second pass.
+ * @param thread_pool The threads to sort with, may be nullptr.
  */
-unsigned int SpatialHashStructure::hash(int3 index) const
+template <typename Key>
+void SpatialHashStructure::radix_sort(std::vector<Key> &keys, std::vector<Key> &scratch, ThreadPool *thread_pool)
+{
+	size_t size = keys.size();
+	if (size == 0)
+		return;
+
+	size_t chunk_count = thread_pool != nullptr ? thread_pool->get_thread_count() : 1;
+	size_t chunk_size = (size + chunk_count - 1) / chunk_count;
+	scratch.resize(size);
+	sort_particles.resize(size);
+	digit_counts.resize(chunk_count * radix_size);
+	chunk_bits.resize(chunk_count);
+
+	// Find the bits which differ between the keys.
+	run_loop(thread_pool, 0, chunk_count, [&](size_t chunk_begin, size_t chunk_end)
+			 {
+		for (size_t chunk = chunk_begin; chunk < chunk_end; chunk++)
+		{
+			uint64_t bits = 0;
+			size_t last = std::min(size, (chunk + 1) * chunk_size);
+			for (size_t i = chunk * chunk_size; i < last; i++)
+				bits |= keys[i] ^ keys[0];
+			chunk_bits[chunk] = bits;
+		} }, 1);
+	uint64_t varying_bits = 0;
+	for (uint64_t bits : chunk_bits)
+		varying_bits |= bits;
+
+	for (unsigned int shift = 0; shift < sizeof(Key) * 8; shift += radix_bits)
+	{
+		if (((varying_bits >> shift) & (radix_size - 1)) == 0)
+			continue;
+
+		// The keys and particles of the last pass are the input of this one.
+		std::swap(keys, scratch);
+		std::swap(particles, sort_particles);
+
+		// Histogram of the digits of every chunk.
+		run_loop(thread_pool, 0, chunk_count, [&](size_t chunk_begin, size_t chunk_end)
+				 {
+			for (size_t chunk = chunk_begin; chunk < chunk_end; chunk++)
+			{
+				unsigned int *counts = digit_counts.data() + chunk * radix_size;
+				std::fill(counts, counts + radix_size, 0);
+				size_t last = std::min(size, (chunk + 1) * chunk_size);
+				for (size_t i = chunk * chunk_size; i < last; i++)
+					counts[(scratch[i] >> shift) & (radix_size - 1)]++;
+			} }, 1);
+
+		// Exclusive scan, digit by digit and chunk by chunk, which keeps the sort stable.
+		// The histograms are tiny compared to the particles, so this is done serially.
+		unsigned int sum = 0;
+		for (unsigned int digit = 0; digit < radix_size; digit++)
+		{
+			for (size_t chunk = 0; chunk < chunk_count; chunk++)
+			{
+				unsigned int count = digit_counts[chunk * radix_size + digit];
+				digit_counts[chunk * radix_size + digit] = sum;
+				sum += count;
+			}
+		}
+
+		run_loop(thread_pool, 0, chunk_count, [&](size_t chunk_begin, size_t chunk_end)
+				 {
+			for (size_t chunk = chunk_begin; chunk < chunk_end; chunk++)
+			{
+				unsigned int *offsets = digit_counts.data() + chunk * radix_size;
+				size_t last = std::min(size, (chunk + 1) * chunk_size);
+				for (size_t i = chunk * chunk_size; i < last; i++)
+				{
+					unsigned int index = offsets[(scratch[i] >> shift) & (radix_size - 1)]++;
+					keys[index] = scratch[i];
+					particles[index] = sort_particles[i];
+				}
+			} }, 1);
+	}
+}
+
+/**
+ * @brief Compact build. Sorts the particles by cell key, then builds the cells.
+ *
+ * @param vertices The particles to be discretized
+ * @param thread_pool The threads to build with, may be nullptr.
+ */
+void SpatialHashStructure::rebuild_compact(const ParticleStore &vertices, ThreadPool *thread_pool)
 {
-	int v = (index.data[0] * 92837111) ^ (index.data[1] * 689287499) ^ (index.data[2] * 283923481);
-	v = std::abs(v) % (table_size - 1);
-	return v;
+	size_t size = vertices.size();
+	particles.resize(size);
+	particle_coordinates.resize(size);
+	sorted_cell_keys.resize(size);
+
+	run_loop(thread_pool, 0, size, [&](size_t begin, size_t end)
+			 {
+		for (size_t i = begin; i < end; i++)
+		{
+			particle_coordinates[i] = compute_cell(vertices.x[i], vertices.y[i], vertices.z[i]);
+			sorted_cell_keys[i] = compute_cell_key(particle_coordinates[i]);
+			particles[i] = i;
+		} }, 4096);
+
+	radix_sort(sorted_cell_keys, sort_cell_keys, thread_pool);
+	build_cells(thread_pool);
+	gather_positions(vertices, thread_pool);
 }
 
 /**
- * @brief Compute the neighboring cells of a vertex
+ * @brief Copy the positions of the particles into the order of the particles array,
+ * so the particles of a cell are next to each other in memory.
  *
- * @param v The vertex to compute the neighbors of
- * @return std::vector<unsigned int> The neighboring cells
+ * @param vertices The particles the table was built with
+ * @param thread_pool The threads to copy with, may be nullptr.
  */
-std::vector<unsigned int> SpatialHashStructure::compute_neighbor_cells(const vec3 &v) const
+void SpatialHashStructure::gather_positions(const ParticleStore &vertices, ThreadPool *thread_pool)
 {
-	std::vector<unsigned int> neighbors;
-	neighbors.reserve(27);
+	size_t size = vertices.size();
+	sorted_x.resize(size);
+	sorted_y.resize(size);
+	sorted_z.resize(size);
+	run_loop(thread_pool, 0, size, [&](size_t begin, size_t end)
+			 {
+		for (size_t p = begin; p < end; p++)
+		{
+			unsigned int i = particles[p];
+			sorted_x[p] = vertices.x[i];
+			sorted_y[p] = vertices.y[i];
+			sorted_z[p] = vertices.z[i];
+		} }, 4096);
+}
+
+/**
+ * @brief Compact mode. Collect the occupied cells from the sorted cell keys of the particles
+ * and insert them into an index with at least twice as many slots as cells.
+ *
+ * @param thread_pool The threads to build with, may be nullptr.
+ */
+void SpatialHashStructure::build_cells(ThreadPool *thread_pool)
+{
+	size_t size = particles.size();
 
-	int x = std::floor(v.entries[0] / spacing);
-	int y = std::floor(v.entries[1] / spacing);
-	int z = std::floor(v.entries[2] / spacing);
-	int3 index3 = {x, y, z};
+	// A cell starts wherever the key changes. Every chunk counts its cells first,
+	// so it knows where to store them.
+	size_t chunk_count = thread_pool != nullptr ? thread_pool->get_thread_count() : 1;
+	size_t chunk_size = (size + chunk_count - 1) / chunk_count;
+	chunk_cell_offsets.resize(chunk_count);
+	run_loop(thread_pool, 0, chunk_count, [&](size_t chunk_begin, size_t chunk_end)
+			 {
+		for (size_t chunk = chunk_begin; chunk < chunk_end; chunk++)
+		{
+			unsigned int count = 0;
+			size_t last = std::min(size, (chunk + 1) * chunk_size);
+			for (size_t p = chunk * chunk_size; p < last; p++)
+				count += p == 0 || sorted_cell_keys[p] != sorted_cell_keys[p - 1];
+			chunk_cell_offsets[chunk] = count;
+		} }, 1);
 
-	for (int x = index3.data[0] - 1; x < index3.data[0] + 2; x++)
+	unsigned int cell_count = 0;
+	for (unsigned int &offset : chunk_cell_offsets)
 	{
-		for (int y = index3.data[1] - 1; y < index3.data[1] + 2; y++)
+		unsigned int count = offset;
+		offset = cell_count;
+		cell_count += count;
+	}
+
+	cell_keys.resize(cell_count);
+	cell_starts.resize(cell_count + 2);
+	run_loop(thread_pool, 0, chunk_count, [&](size_t chunk_begin, size_t chunk_end)
+			 {
+		for (size_t chunk = chunk_begin; chunk < chunk_end; chunk++)
+		{
+			unsigned int cell = chunk_cell_offsets[chunk];
+			size_t last = std::min(size, (chunk + 1) * chunk_size);
+			for (size_t p = chunk * chunk_size; p < last; p++)
+			{
+				if (p == 0 || sorted_cell_keys[p] != sorted_cell_keys[p - 1])
+				{
+					cell_keys[cell] = sorted_cell_keys[p];
+					cell_starts[cell] = p;
+					cell++;
+				}
+			}
+		} }, 1);
+	// The last cell is empty and stands for all cells without particles.
+	cell_starts[cell_count] = size;
+	cell_starts[cell_count + 1] = size;
+
+	// Keep the load factor at or below one half, so the probe sequences stay short.
+	size_t index_size = std::bit_ceil(std::max<size_t>(2 * cell_count, 16));
+	cell_index.resize(index_size);
+	index_mask = index_size - 1;
+	run_loop(thread_pool, 0, index_size, [&](size_t begin, size_t end)
+			 {
+		for (size_t slot = begin; slot < end; slot++)
+			cell_index[slot].cell = empty_slot; }, 4096);
+
+	// Linear probing. Threads claim a slot by swapping in the cell, the key is only read
+	// after the build, so it can be written afterwards.
+	run_loop(thread_pool, 0, cell_count, [&](size_t begin, size_t end)
+			 {
+		for (size_t cell = begin; cell < end; cell++)
 		{
-			for (int z = index3.data[2] - 1; z < index3.data[2] + 2; z++)
+			uint64_t slot = hash_cell_key(cell_keys[cell]) & index_mask;
+			while (true)
 			{
-				neighbors.push_back(hash(int3{x, y, z}));
+				std::atomic_ref<unsigned int> slot_cell(cell_index[slot].cell);
+				unsigned int expected = empty_slot;
+				if (slot_cell.compare_exchange_strong(expected, cell, std::memory_order_relaxed))
+				{
+					cell_index[slot].key = cell_keys[cell];
+					break;
+				}
+				slot = (slot + 1) & index_mask;
+			}
+		} }, 1024);
+}
+
+/**
+ * @brief Bring the table up to date with the particles, moving only the particles
+ * which changed their cell. Falls back to a full rebuild when more than the rebuild
+ * fraction of the particles changed their cell.
+ *
+ * @param vertices The particles to be discretized
+ * @param thread_pool The threads to update the table with
+ */
+void SpatialHashStructure::update(const ParticleStore &vertices, ThreadPool &thread_pool)
+{
+	if (move_particles(vertices, thread_pool))
+	{
+		gather_positions(vertices, &thread_pool);
+		incremental_updates++;
+	}
+	else
+	{
+		rebuild(vertices, thread_pool);
+		full_rebuilds++;
+	}
+}
+
+/**
+ * @brief Move the particles which changed their cell to their new cell. The particles
+ * keep the order a full rebuild would give them, by cell (compact) or table entry (sparse),
+ * then by index.
+ *
+ * @param vertices The particles to be discretized
+ * @param thread_pool The threads to update the table with
+ * @returns If the table was updated, false if it has to be rebuilt.
+ */
+bool SpatialHashStructure::move_particles(const ParticleStore &vertices, ThreadPool &thread_pool)
+{
+	size_t size = vertices.size();
+	if (rebuild_fraction <= 0.0f || particle_coordinates.size() != size)
+		return false;
+
+	// Flag the particles which left their cell, every chunk counts its own.
+	size_t chunk_count = thread_pool.get_thread_count();
+	size_t chunk_size = (size + chunk_count - 1) / chunk_count;
+	particle_moved.resize(size);
+	chunk_cell_offsets.resize(chunk_count);
+	thread_pool.parallel_for(0, chunk_count, [&](size_t chunk_begin, size_t chunk_end)
+							 {
+		for (size_t chunk = chunk_begin; chunk < chunk_end; chunk++)
+		{
+			unsigned int count = 0;
+			size_t last = std::min(size, (chunk + 1) * chunk_size);
+			for (size_t i = chunk * chunk_size; i < last; i++)
+			{
+				bool moved = !(compute_cell(vertices.x[i], vertices.y[i], vertices.z[i]) == particle_coordinates[i]);
+				particle_moved[i] = moved;
+				count += moved;
+			}
+			chunk_cell_offsets[chunk] = count;
+		} }, 1);
+
+	size_t moved_count = 0;
+	for (unsigned int count : chunk_cell_offsets)
+		moved_count += count;
+	if (moved_count > rebuild_fraction * size)
+		return false;
+	if (moved_count == 0)
+		return true;
+
+	// The key a particle is sorted by.
+	auto sort_key = [this](unsigned int i) -> uint64_t
+	{
+		return mode == SpatialHashMode::COMPACT ? compute_cell_key(particle_coordinates[i]) : particle_cells[i];
+	};
+
+	// Keys of the moved particles before and after the move.
+	removed_keys.clear();
+	inserted_particles.clear();
+	for (size_t i = 0; i < size; i++)
+	{
+		if (!particle_moved[i])
+			continue;
+		removed_keys.push_back(sort_key(i));
+		particle_coordinates[i] = compute_cell(vertices.x[i], vertices.y[i], vertices.z[i]);
+		if (mode == SpatialHashMode::SPARSE_TABLE)
+			particle_cells[i] = hash(particle_coordinates[i]);
+		inserted_particles.emplace_back(sort_key(i), i);
+	}
+	std::sort(removed_keys.begin(), removed_keys.end());
+	std::sort(inserted_particles.begin(), inserted_particles.end());
+
+	// Merge the particles which stayed with the moved ones.
+	sort_particles.resize(size);
+	size_t inserted = 0;
+	size_t out = 0;
+	for (size_t s = 0; s < size; s++)
+	{
+		unsigned int i = particles[s];
+		if (particle_moved[i])
+			continue;
+		std::pair<uint64_t, unsigned int> key(sort_key(i), i);
+		while (inserted < inserted_particles.size() && inserted_particles[inserted] < key)
+			sort_particles[out++] = inserted_particles[inserted++].second;
+		sort_particles[out++] = i;
+	}
+	while (inserted < inserted_particles.size())
+		sort_particles[out++] = inserted_particles[inserted++].second;
+	std::swap(particles, sort_particles);
+
+	if (mode == SpatialHashMode::COMPACT)
+	{
+		thread_pool.parallel_for(0, size, [&](size_t begin, size_t end)
+								 {
+			for (size_t p = begin; p < end; p++)
+				sorted_cell_keys[p] = compute_cell_key(particle_coordinates[particles[p]]); }, 4096);
+		build_cells(&thread_pool);
+		return true;
+	}
+
+	thread_pool.parallel_for(0, size, [&](size_t begin, size_t end)
+							 {
+		for (size_t p = begin; p < end; p++)
+			cell_coordinates[p] = particle_coordinates[particles[p]]; }, 4096);
+
+	// Entry h starts after all particles with a smaller hash. Between two consecutive
+	// hashes of moved particles, the entries shift by the particles inserted minus
+	// the ones removed before them. Entries before the first and after the last
+	// of these hashes keep their start.
+	int shift = 0;
+	size_t removed = 0;
+	inserted = 0;
+	while (removed < removed_keys.size() || inserted < inserted_particles.size())
+	{
+		uint64_t key = std::min(removed < removed_keys.size() ? removed_keys[removed] : UINT64_MAX,
+								inserted < inserted_particles.size() ? inserted_particles[inserted].first : UINT64_MAX);
+		for (; removed < removed_keys.size() && removed_keys[removed] == key; removed++)
+			shift--;
+		for (; inserted < inserted_particles.size() && inserted_particles[inserted].first == key; inserted++)
+			shift++;
+
+		uint64_t next_key = std::min(removed < removed_keys.size() ? removed_keys[removed] : UINT64_MAX,
+									 inserted < inserted_particles.size() ? inserted_particles[inserted].first : UINT64_MAX);
+		if (next_key == UINT64_MAX)
+			break;
+		unsigned int *entries_end = table.data() + next_key + 1;
+		for (unsigned int *entry = table.data() + key + 1; entry != entries_end; entry++)
+			*entry += shift;
+	}
+	assert(shift == 0);
+	return true;
+}
+
+/**
+ * @brief Collect the pairs within the cutoff, each pair once.
+ * Walks the particles array cell by cell. Every particle is tested against the later
+ * particles of its own cell, then against the particles of the 13 cells at
+ * forward_offsets in the order of the offsets. The candidates of a range of the particles
+ * array are tested at once with the proximity kernel, reading the positions sorted by
+ * cell. In the sparse mode, consecutive particles of one cell share the hashes of their
+ * forward cells, and candidates of other cells sharing a table entry are skipped. In the
+ * compact mode, the three forward cells which only differ in z are next to each other,
+ * so they are tested as one range.
+ *
+ * @param vertices The particles the table was built or updated with
+ * @param cutoff The largest distance of a pair, at most the spacing
+ * @param pairs The pairs are appended to this list
+ */
+void SpatialHashStructure::collect_pairs(const ParticleStore &vertices, float cutoff,
+										 std::vector<RealVector<unsigned int, 2>> &pairs) const
+{
+	assert(cutoff <= spacing && sorted_x.size() == vertices.size());
+	(void)vertices;
+	float cutoff_squared = cutoff * cutoff;
+	// Offsets of the candidates within the cutoff, the ranges are tested in blocks of this size.
+	const unsigned int block_size = 256;
+	unsigned int hits[block_size];
+
+	// Test the particles in [first, last) against particle s. In the sparse mode,
+	// only the ones in the given cell are reported.
+	auto test_range = [&](unsigned int s, unsigned int first, unsigned int last, const int3 *cell)
+	{
+		for (unsigned int block = first; block < last; block += block_size)
+		{
+			size_t count = std::min(block_size, last - block);
+			size_t hit_count = proximity_kernel(sorted_x[s], sorted_y[s], sorted_z[s], sorted_x.data() + block,
+												sorted_y.data() + block, sorted_z.data() + block, count, cutoff_squared, hits);
+			for (size_t h = 0; h < hit_count; h++)
+			{
+				unsigned int t = block + hits[h];
+				if (cell == nullptr || cell_coordinates[t] == *cell)
+					pairs.push_back({particles[s], particles[t]});
 			}
 		}
+	};
+
+	if (mode == SpatialHashMode::COMPACT)
+	{
+		// First cell of each row of three forward cells, then the cell after the own cell.
+		std::array<unsigned int, 5> range_first, range_last;
+		for (unsigned int cell = 0; cell < cell_keys.size(); cell++)
+		{
+			int3 coordinates = decode_cell_key(cell_keys[cell]);
+			for (size_t row = 0; row < 4; row++)
+			{
+				// Empty cells have an empty range, so the row spans from the first to the last occupied cell.
+				range_first[row] = particles.size();
+				range_last[row] = 0;
+				for (size_t n = 3 * row; n < 3 * row + 3; n++)
+				{
+					unsigned int neighbor = find_cell(compute_cell_key(coordinates + forward_offsets[n]));
+					if (neighbor == cell_keys.size())
+						continue;
+					range_first[row] = std::min(range_first[row], cell_starts[neighbor]);
+					range_last[row] = std::max(range_last[row], cell_starts[neighbor + 1]);
+				}
+			}
+			unsigned int next = find_cell(compute_cell_key(coordinates + forward_offsets[12]));
+			range_first[4] = cell_starts[next];
+			range_last[4] = cell_starts[next + 1];
+
+			for (unsigned int s = cell_starts[cell]; s < cell_starts[cell + 1]; s++)
+			{
+				test_range(s, s + 1, cell_starts[cell + 1], nullptr);
+				for (size_t range = 0; range < range_first.size(); range++)
+					test_range(s, range_first[range], range_last[range], nullptr);
+			}
+		}
+		return;
 	}
 
-	return neighbors;
+	std::array<unsigned int, 13> forward_cells;
+	for (unsigned int s = 0; s < particles.size(); s++)
+	{
+		const int3 &cell = cell_coordinates[s];
+		if (s == 0 || !(cell == cell_coordinates[s - 1]))
+		{
+			for (size_t n = 0; n < forward_offsets.size(); n++)
+				forward_cells[n] = hash(cell + forward_offsets[n]);
+		}
+
+		// All particles of the cell are in the same table entry.
+		test_range(s, s + 1, table[particle_cells[particles[s]] + 1], &cell);
+		for (size_t n = 0; n < forward_offsets.size(); n++)
+		{
+			int3 neighbor = cell + forward_offsets[n];
+			test_range(s, table[forward_cells[n]], table[forward_cells[n] + 1], &neighbor);
+		}
+	}
+}
+
+/**
+ * @brief Set when update() gives up on moving single particles and rebuilds the table.
+ *
+ * @param fraction Fraction of the particles which may change their cell, 0 always rebuilds.
+ */
+void SpatialHashStructure::set_rebuild_fraction(float fraction)
+{
+	assert(fraction >= 0.0f && fraction <= 1.0f);
+	rebuild_fraction = fraction;
+}
+
+/**
+ * @returns Fraction of the particles which may change their cell before update() rebuilds the table.
+ */
+float SpatialHashStructure::get_rebuild_fraction() const
+{
+	return rebuild_fraction;
+}
+
+/**
+ * @brief Set the instruction set of the distance tests of collect_pairs().
+ *
+ * @param level The instruction set, must be supported by the CPU.
+ */
+void SpatialHashStructure::set_simd_level(SimdLevel level)
+{
+	proximity_kernel = get_proximity_kernel(level);
+}
+
+/**
+ * @brief Back the pages of the table and the sorted positions from the threads of a pool.
+ * The sorted positions are written in the particle loops of every build, the table
+ * is zeroed on construction by the constructing thread.
+ *
+ * @param particle_count The number of particles the structure will hold
+ * @param thread_pool The threads which will build the structure
+ */
+void SpatialHashStructure::distribute(size_t particle_count, ThreadPool &thread_pool)
+{
+	distribute_pages(table, thread_pool);
+	for (huge_page_vector<float> *array : {&sorted_x, &sorted_y, &sorted_z})
+	{
+		array->resize(particle_count);
+		distribute_pages(*array, thread_pool);
+	}
+}
+
+/**
+ * @returns How the cells are stored.
+ */
+SpatialHashMode SpatialHashStructure::get_mode() const
+{
+	return mode;
+}
+
+/**
+ * @returns The edge length of the grid cells.
+ */
+float SpatialHashStructure::get_spacing() const
+{
+	return spacing;
+}
+
+/**
+ * @brief Measure how well the table is used by the particles of the last build.
+ * Walks the whole table, meant for tuning rather than for every substep.
+ *
+ * @return SpatialHashStatistics The occupancy of the table
+ */
+SpatialHashStatistics SpatialHashStructure::get_statistics() const
+{
+	SpatialHashStatistics statistics = {};
+	size_t chain_sum = 0;
+	size_t used_entries = 0;
+
+	if (mode == SpatialHashMode::COMPACT)
+	{
+		statistics.occupied_cells = cell_keys.size();
+		statistics.table_size = cell_index.size();
+		for (size_t slot = 0; slot < cell_index.size(); slot++)
+		{
+			if (cell_index[slot].cell == empty_slot)
+				continue;
+			// Slots probed from the home slot of the key up to this one.
+			size_t chain = ((slot - hash_cell_key(cell_index[slot].key)) & index_mask) + 1;
+			chain_sum += chain;
+			statistics.max_chain_length = std::max(statistics.max_chain_length, chain);
+			used_entries++;
+		}
+		statistics.memory_bytes = cell_index.size() * sizeof(IndexSlot) + cell_keys.size() * sizeof(uint64_t) +
+								  cell_starts.size() * sizeof(unsigned int);
+	}
+	else
+	{
+		statistics.table_size = table_size - 1;
+		for (size_t h = 0; h + 1 < table_size; h++)
+		{
+			if (table[h] == table[h + 1])
+				continue;
+			// Count the different cells in the entry.
+			size_t chain = 0;
+			for (unsigned int s = table[h]; s < table[h + 1]; s++)
+			{
+				auto first = cell_coordinates.begin() + table[h];
+				chain += std::find(first, cell_coordinates.begin() + s, cell_coordinates[s]) == cell_coordinates.begin() + s;
+			}
+			chain_sum += chain;
+			statistics.occupied_cells += chain;
+			statistics.max_chain_length = std::max(statistics.max_chain_length, chain);
+			used_entries++;
+		}
+		statistics.memory_bytes = table.size() * sizeof(unsigned int);
+	}
+
+	statistics.incremental_updates = incremental_updates;
+	statistics.full_rebuilds = full_rebuilds;
+	statistics.load_factor = statistics.table_size > 0 ? float(used_entries) / statistics.table_size : 0.0f;
+	statistics.mean_chain_length = used_entries > 0 ? float(chain_sum) / used_entries : 0.0f;
+	return statistics;
+}
+
+/**
+ * @brief Compute the grid cell of a vertex
+ *
+ * @param x The x coordinate of the vertex
+ * @param y The y coordinate of the vertex
+ * @param z The z coordinate of the vertex
+ * @return int3 The cell coordinates
+ */
+int3 SpatialHashStructure::compute_cell(float x, float y, float z) const
+{
+	return {(int)std::floor(x / spacing), (int)std::floor(y / spacing), (int)std::floor(z / spacing)};
+}
+
+/**
+ * @brief Pack the coordinates of a cell into a 64-bit key, 21 bits each.
+ * Sorting by key orders the cells by x, then y, then z.
+ *
+ * @param cell The cell coordinates
+ * @return uint64_t The cell key
+ */
+uint64_t SpatialHashStructure::compute_cell_key(int3 cell)
+{
+	uint64_t x = static_cast<uint64_t>(cell.data[0] + cell_key_offset) & cell_key_mask;
+	uint64_t y = static_cast<uint64_t>(cell.data[1] + cell_key_offset) & cell_key_mask;
+	uint64_t z = static_cast<uint64_t>(cell.data[2] + cell_key_offset) & cell_key_mask;
+	return (x << (2 * cell_key_bits)) | (y << cell_key_bits) | z;
+}
+
+/**
+ * @brief Unpack the coordinates of a cell from its key
+ *
+ * @param key The cell key
+ * @return int3 The cell coordinates
+ */
+int3 SpatialHashStructure::decode_cell_key(uint64_t key)
+{
+	return {static_cast<int>((key >> (2 * cell_key_bits)) & cell_key_mask) - cell_key_offset,
+			static_cast<int>((key >> cell_key_bits) & cell_key_mask) - cell_key_offset,
+			static_cast<int>(key & cell_key_mask) - cell_key_offset};
+}
+
+/**
+ * @brief Mix the bits of a cell key (MurmurHash3 finalizer), so neighboring cells
+ * land in different slots of the index after masking.
+ *
+ * @param key The cell key
+ * @return uint64_t The hashed key
+ */
+uint64_t SpatialHashStructure::hash_cell_key(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ull;
+	key ^= key >> 33;
+	return key;
+}
+
+/**
+ * @brief Look up an occupied cell in the compact index
+ *
+ * @param key The cell key
+ * @return unsigned int The index of the cell, or the index of the empty cell
+ */
+unsigned int SpatialHashStructure::find_cell(uint64_t key) const
+{
+	for (uint64_t slot = hash_cell_key(key) & index_mask;; slot = (slot + 1) & index_mask)
+	{
+		const IndexSlot &entry = cell_index[slot];
+		if (entry.cell == empty_slot)
+			return cell_keys.size();
+		if (entry.key == key)
+			return entry.cell;
+	}
+}
+
+/**
+ * @brief Compute the hash index of a vertex
+ *
+ * @param x The x coordinate of the vertex to be hashed
+ * @param y The y coordinate of the vertex to be hashed
+ * @param z The z coordinate of the vertex to be hashed
+ * @return unsigned int The hash index
+ */
+unsigned int SpatialHashStructure::compute_hash_index(float x, float y, float z) const
+{
+	unsigned int h = hash(compute_cell(x, y, z));
+
+	return h;
+}
+
+/**
+ * @brief Hashes an index
+ *
+ * @param index index to be hashed
+ * @return unsigned int hashed index
+ */
+unsigned int SpatialHashStructure::hash(int3 index) const
+{
+	// Multiply as unsigned, signed multiplication would overflow for most cells.
+	unsigned int v = (static_cast<unsigned int>(index.data[0]) * 92837111u) ^
+					 (static_cast<unsigned int>(index.data[1]) * 689287499u) ^
+					 (static_cast<unsigned int>(index.data[2]) * 283923481u);
+	return v % (table_size - 1);
 }
 
 /**
@@ -109,6 +890,11 @@ std::vector<unsigned int> SpatialHashStructure::compute_neighbor_cells(const vec
  */
 std::pair<unsigned int, unsigned int> SpatialHashStructure::get_particle_range_in_cell(unsigned int cell_idx) const
 {
-	assert(cell_idx < table.size() + 1);
+	if (mode == SpatialHashMode::COMPACT)
+	{
+		assert(cell_idx + 1 < cell_starts.size());
+		return std::pair<unsigned int, unsigned int>(cell_starts[cell_idx], cell_starts[cell_idx + 1]);
+	}
+	assert(cell_idx + 1 < table.size());
 	return std::pair<unsigned int, unsigned int>(table[cell_idx], table[cell_idx + 1]);
 }
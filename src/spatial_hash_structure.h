@@ -1,27 +1,146 @@
 #pragma once
-#include "cloth_mesh.h"
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include "algebraic_types.h"
+#include "linear_algebra.h"
+#include "particle_store.h"
+#include "broad_phase.h"
+#include "huge_page_allocator.h"
+#include "distance_kernel.h"
 
-class SpatialHashStructure
+class ThreadPool;
+
+// Determines how the cells of the spatial hash are stored.
+enum SpatialHashMode
+{
+	// A table with a fixed number of entries, the cells are hashed into it with a modulo.
+	// Several cells may share an entry.
+	SPARSE_TABLE,
+	// The particles are sorted by a 64-bit cell key and only the occupied cells are kept,
+	// found through a small open addressing index. Memory grows with the occupied cells.
+	COMPACT
+};
+
+// Occupancy of the spatial hash, to size the table for a mesh.
+struct SpatialHashStatistics
+{
+	// Cells containing at least one particle.
+	size_t occupied_cells;
+	// Entries of the table (sparse) or slots of the index (compact).
+	size_t table_size;
+	// Occupied entries or slots divided by the table size.
+	float load_factor;
+	// Sparse: cells sharing an occupied entry. Compact: slots probed to find an occupied cell.
+	float mean_chain_length;
+	size_t max_chain_length;
+	// Bytes held by the table or index and the cell offsets.
+	size_t memory_bytes;
+	// Calls of update() which moved single particles, and the ones which rebuilt the table.
+	unsigned long long incremental_updates;
+	unsigned long long full_rebuilds;
+};
+
+/**
+ * Sorts the particles into the cells of a uniform grid and hashes the cells into a table.
+ * The structure is meant to be long-lived: rebuild() reuses all buffers, so updating it
+ * to new particle positions does not allocate as long as the particle count stays the same.
+ * @brief Spatial hash of the particles for neighbor queries.
+ */
+class SpatialHashStructure : public BroadPhase
 {
 
 public:
-	SpatialHashStructure(const std::vector<vec3> &vertices, float spacing, int table_size);
+	SpatialHashStructure(float spacing = 1.0f, unsigned int table_size = 1, SpatialHashMode mode = SpatialHashMode::SPARSE_TABLE);
+	SpatialHashStructure(const ParticleStore &particles, float spacing, unsigned int table_size);
+
+	void rebuild(const ParticleStore &particles);
+	void rebuild(const ParticleStore &particles, ThreadPool &thread_pool);
+	void update(const ParticleStore &particles, ThreadPool &thread_pool) override;
+	void collect_pairs(const ParticleStore &particles, float cutoff,
+					   std::vector<RealVector<unsigned int, 2>> &pairs) const override;
+
+	void set_rebuild_fraction(float fraction);
+	void set_simd_level(SimdLevel level) override;
+	void distribute(size_t particle_count, ThreadPool &thread_pool) override;
+	float get_rebuild_fraction() const;
+
+	SpatialHashMode get_mode() const;
+	float get_spacing() const;
+	SpatialHashStatistics get_statistics() const;
 
 private:
+	SpatialHashMode mode;
 	unsigned int table_size;
-	std::vector<unsigned int> table;
+	huge_page_vector<unsigned int> table;
 	std::vector<unsigned int> particles;
+	// Hash of the cell of every particle, so each particle is hashed once per rebuild.
+	std::vector<unsigned int> particle_cells;
+	// Grid cell of every entry of the particles array. Several cells may share a table
+	// entry, so the cells tell the particles of different cells apart.
+	std::vector<int3> cell_coordinates;
+	// Grid cell of every particle at the last build or update.
+	std::vector<int3> particle_coordinates;
+	// Positions of the particles in the order of the particles array at the last
+	// build or update, so the candidates of a cell are read without indirection.
+	huge_page_vector<float> sorted_x, sorted_y, sorted_z;
+	ProximityKernel proximity_kernel;
 	float spacing;
 
-	unsigned int compute_hash_index(const vec3 &v) const;
+	// Incremental updates. Particles which left their cell, their keys before
+	// the update, and their keys after the update together with their index.
+	float rebuild_fraction;
+	std::vector<unsigned char> particle_moved;
+	std::vector<uint64_t> removed_keys;
+	std::vector<std::pair<uint64_t, unsigned int>> inserted_particles;
+	unsigned long long incremental_updates;
+	unsigned long long full_rebuilds;
+
+	// Compact mode. The particles of occupied cell c are particles[cell_starts[c]] up to
+	// particles[cell_starts[c + 1]] (exclusive). One more empty cell at the end stands
+	// for all cells without particles.
+	std::vector<uint64_t> cell_keys;
+	std::vector<unsigned int> cell_starts;
+	// Open addressing index from cell key to occupied cell, with a power of two size.
+	struct IndexSlot
+	{
+		uint64_t key;
+		unsigned int cell;
+	};
+	std::vector<IndexSlot> cell_index;
+	uint64_t index_mask;
+	static constexpr unsigned int empty_slot = ~0u;
+
+	// Scratch buffers of the builds. Radix sort keys and particles, and
+	// the digit histograms of every chunk.
+	std::vector<unsigned int> sort_keys, sorted_keys, sort_particles;
+	std::vector<uint64_t> sort_cell_keys, sorted_cell_keys;
+	std::vector<unsigned int> digit_counts;
+	std::vector<uint64_t> chunk_bits;
+	std::vector<unsigned int> chunk_cell_offsets;
+
+	unsigned int compute_hash_index(float x, float y, float z) const;
 	unsigned int hash(int3 index) const;
 
+	static uint64_t compute_cell_key(int3 cell);
+	static int3 decode_cell_key(uint64_t key);
+	static uint64_t hash_cell_key(uint64_t key);
+	unsigned int find_cell(uint64_t key) const;
+	void rebuild_compact(const ParticleStore &particles, ThreadPool *thread_pool);
+	void build_cells(ThreadPool *thread_pool);
+	bool move_particles(const ParticleStore &particles, ThreadPool &thread_pool);
+	void gather_positions(const ParticleStore &particles, ThreadPool *thread_pool);
+
+	template <typename Key>
+	void radix_sort(std::vector<Key> &keys, std::vector<Key> &scratch, ThreadPool *thread_pool);
+
 public:
-	std::vector<unsigned int> compute_neighbor_cells(const vec3 &v) const;
+	int3 compute_cell(float x, float y, float z) const;
 	std::pair<unsigned int, unsigned int> get_particle_range_in_cell(unsigned int particle_idx) const;
 
 	inline const std::vector<unsigned int> &get_particles_arr() const
 	{
 		return particles;
 	}
-};
\ No newline at end of file
+};
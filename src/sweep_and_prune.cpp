@@ -0,0 +1,140 @@
+#include "sweep_and_prune.h"
+#include <cassert>
+#include <algorithm>
+#include <limits>
+#include "thread_pool.h"
+
+/**
+ * @brief Construct a new empty Sweep And Prune:: Sweep And Prune object
+ * Call update() to fill it with particles.
+ */
+SweepAndPrune::SweepAndPrune()
+{
+	axis = 0;
+}
+
+/**
+ * @brief Sort the particles along the axis of their largest extent again.
+ * Starts from the order of the last update, unless the axis changed.
+ *
+ * @param vertices The particles to be sorted
+ * @param thread_pool The threads to read the coordinates with
+ */
+void SweepAndPrune::update(const ParticleStore &vertices, ThreadPool &thread_pool)
+{
+	size_t size = vertices.size();
+	const float *coordinates[3] = {vertices.x.data(), vertices.y.data(), vertices.z.data()};
+
+	float extent[3];
+	for (int a = 0; a < 3; a++)
+	{
+		float lower = std::numeric_limits<float>::max();
+		float upper = std::numeric_limits<float>::lowest();
+		for (size_t i = 0; i < size; i++)
+		{
+			lower = std::min(lower, coordinates[a][i]);
+			upper = std::max(upper, coordinates[a][i]);
+		}
+		extent[a] = upper - lower;
+	}
+	int largest_axis = std::max_element(extent, extent + 3) - extent;
+
+	if (largest_axis != axis || particles.size() != size)
+	{
+		axis = largest_axis;
+		sort_from_scratch(vertices);
+		return;
+	}
+
+	const float *coordinate = coordinates[axis];
+	thread_pool.parallel_for(0, size, [&](size_t begin, size_t end)
+							 {
+		for (size_t s = begin; s < end; s++)
+			keys[s] = coordinate[particles[s]]; }, 4096);
+
+	// Insertion sort. Gives up once the particles were shuffled too much,
+	// the sort from scratch is cheaper then.
+	size_t moves = 0;
+	size_t max_moves = 8 * size;
+	for (size_t s = 1; s < size; s++)
+	{
+		float key = keys[s];
+		unsigned int particle = particles[s];
+		size_t t = s;
+		for (; t > 0 && keys[t - 1] > key; t--)
+		{
+			keys[t] = keys[t - 1];
+			particles[t] = particles[t - 1];
+		}
+		keys[t] = key;
+		particles[t] = particle;
+
+		moves += s - t;
+		if (moves > max_moves)
+		{
+			sort_from_scratch(vertices);
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Collect the pairs within the cutoff. Scans the particles following each
+ * particle in sweep order until their coordinate along the axis exceeds the cutoff.
+ *
+ * @param vertices The particles the sweep and prune was updated with
+ * @param cutoff The largest distance of a pair
+ * @param pairs The pairs are appended to this list
+ */
+void SweepAndPrune::collect_pairs(const ParticleStore &vertices, float cutoff,
+								  std::vector<RealVector<unsigned int, 2>> &pairs) const
+{
+	const float *x = vertices.x.data();
+	const float *y = vertices.y.data();
+	const float *z = vertices.z.data();
+	float cutoff_squared = cutoff * cutoff;
+
+	for (size_t s = 0; s < particles.size(); s++)
+	{
+		unsigned int i = particles[s];
+		float limit = keys[s] + cutoff;
+		for (size_t t = s + 1; t < particles.size() && keys[t] <= limit; t++)
+		{
+			unsigned int j = particles[t];
+			float delta_x = x[i] - x[j];
+			float delta_y = y[i] - y[j];
+			float delta_z = z[i] - z[j];
+			if (delta_x * delta_x + delta_y * delta_y + delta_z * delta_z <= cutoff_squared)
+				pairs.push_back({i, j});
+		}
+	}
+}
+
+/**
+ * @returns The sweep axis of the last update, 0 for x, 1 for y and 2 for z.
+ */
+int SweepAndPrune::get_axis() const
+{
+	return axis;
+}
+
+/**
+ * @brief Sort all particles along the sweep axis, ties by index.
+ *
+ * @param vertices The particles to be sorted
+ */
+void SweepAndPrune::sort_from_scratch(const ParticleStore &vertices)
+{
+	const float *coordinate = axis == 0 ? vertices.x.data() : axis == 1 ? vertices.y.data() : vertices.z.data();
+	size_t size = vertices.size();
+
+	// Only allocates when the particle count grew.
+	particles.resize(size);
+	keys.resize(size);
+	for (size_t i = 0; i < size; i++)
+		particles[i] = i;
+	std::sort(particles.begin(), particles.end(), [&](unsigned int a, unsigned int b)
+			  { return coordinate[a] < coordinate[b] || (coordinate[a] == coordinate[b] && a < b); });
+	for (size_t s = 0; s < size; s++)
+		keys[s] = coordinate[particles[s]];
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <vector>
+#include "algebraic_types.h"
+#include "broad_phase.h"
+#include "particle_store.h"
+
+/**
+ * The particles are kept sorted by their coordinate along the axis in which the
+ * particles spread the most. The order of the last update is sorted again with an
+ * insertion sort, which is close to linear as long as the particles move little
+ * relative to each other. The pairs of a particle are the following particles
+ * until their coordinate is further away than the cutoff.
+ * @brief Sort based sweep and prune along one axis, independent of any cell size.
+ */
+class SweepAndPrune : public BroadPhase
+{
+public:
+	SweepAndPrune();
+
+	void update(const ParticleStore &particles, ThreadPool &thread_pool) override;
+	void collect_pairs(const ParticleStore &particles, float cutoff,
+					   std::vector<RealVector<unsigned int, 2>> &pairs) const override;
+
+	int get_axis() const;
+
+private:
+	// The sweep axis, 0 for x, 1 for y and 2 for z.
+	int axis;
+	// The particles in sweep order and their coordinate along the axis.
+	std::vector<unsigned int> particles;
+	std::vector<float> keys;
+
+	void sort_from_scratch(const ParticleStore &vertices);
+};
@@ -0,0 +1,349 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <cassert>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+// Number of times an idle worker checks for new work before it goes to sleep.
+// Keeps the latency between consecutive loops low.
+static const int spin_count = 1000;
+
+// Pool and slot of the current thread, used to find the slot of the thread calling parallel_for.
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local unsigned int current_slot = 0;
+
+/**
+ * @brief Construct a new Thread Pool:: Thread Pool object
+ *
+ * @param thread_count Number of threads working on a loop, including the caller.
+ * @param affinity CPUs to pin the workers to. The worker with slot i is pinned to
+ * affinity[i % affinity.size()], slot 0 is the calling thread, which is not pinned.
+ * An empty list leaves the scheduling to the operating system.
+ */
+ThreadPool::ThreadPool(unsigned int thread_count, const std::vector<int> &affinity) : parked(false), generation(0)
+{
+	thread_count = std::max(thread_count, 1u);
+	slots = std::make_unique<Slot[]>(thread_count);
+	workers.reserve(thread_count - 1);
+	for (unsigned int i = 1; i < thread_count; i++)
+	{
+		int cpu = affinity.empty() ? -1 : affinity[i % affinity.size()];
+		workers.emplace_back([this, i, cpu]()
+							 { worker_loop(i, cpu); });
+	}
+}
+
+/**
+ * @brief Destroy the Thread Pool:: Thread Pool object
+ * Waits for a pending asynchronous task, then stops and joins all workers.
+ */
+ThreadPool::~ThreadPool()
+{
+	wait_async();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		generation++;
+	}
+	wake_up.notify_all();
+	for (std::thread &worker : workers)
+	{
+		worker.join();
+	}
+}
+
+/**
+ * @returns The number of threads working on a loop, including the caller.
+ */
+unsigned int ThreadPool::get_thread_count() const
+{
+	return workers.size() + 1;
+}
+
+/**
+ * @brief Execute a loop in parallel and wait for it to finish.
+ *
+ * @param begin First index of the loop.
+ * @param end Index after the last index of the loop.
+ * @param body Function processing the index range [chunk_begin, chunk_end).
+ * @param grain_size Minimum number of indices per chunk.
+ */
+void ThreadPool::run_loop(size_t begin, size_t end, LoopBody body, size_t grain_size)
+{
+	if (begin >= end)
+		return;
+
+	// Small loops are not worth waking up the workers.
+	size_t count = end - begin;
+	if (workers.empty() || count <= grain_size)
+	{
+		body.call(body.object, begin, end);
+		return;
+	}
+
+	unsigned int own_slot = current_pool == this ? current_slot : 0;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		assert(job.object == nullptr);
+
+		// Split the loop evenly between all threads.
+		unsigned int thread_count = get_thread_count();
+		size_t share = count / thread_count;
+		for (unsigned int i = 0; i < thread_count; i++)
+		{
+			slots[i].begin = begin + i * share;
+			slots[i].end = i + 1 == thread_count ? end : begin + (i + 1) * share;
+		}
+
+		job = body;
+		job_grain = std::max<size_t>(grain_size, 1);
+		job_region = get_allocation_region();
+		generation++;
+	}
+	wake_up.notify_all();
+
+	run_slots(own_slot);
+
+	// Every index is taken once stealing failed. Wait until the workers
+	// processed their chunks and left the loop, so the body may go out of scope.
+	std::unique_lock<std::mutex> lock(mutex);
+	job_done.wait(lock, [this]()
+				  { return active_workers == 0; });
+	job = {nullptr, nullptr};
+}
+
+/**
+ * @brief Run a task on a worker. Runs the task inline if the pool has no workers.
+ *
+ * @param task The task to run.
+ */
+void ThreadPool::run_async(std::function<void()> task)
+{
+	if (workers.empty())
+	{
+		task();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		assert(!async_pending && !async_running);
+		async_task = std::move(task);
+		async_pending = true;
+		generation++;
+	}
+	wake_up.notify_all();
+}
+
+/**
+ * @brief Block until the asynchronous task finished.
+ */
+void ThreadPool::wait_async()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	async_done.wait(lock, [this]()
+					{ return !async_pending && !async_running; });
+}
+
+/**
+ * @brief Parked workers go to sleep as soon as they are idle.
+ * Use this while no loops are expected, e.g. when the simulation is paused.
+ *
+ * @param _parked If the workers should be parked.
+ */
+void ThreadPool::set_parked(bool _parked)
+{
+	parked.store(_parked);
+}
+
+/**
+ * @brief Process chunks of the own slot, then steal from other slots until no work is left.
+ *
+ * @param own_slot The slot of the calling thread.
+ */
+void ThreadPool::run_slots(unsigned int own_slot)
+{
+	size_t chunk_begin, chunk_end;
+	do
+	{
+		while (pop(own_slot, chunk_begin, chunk_end))
+		{
+			job.call(job.object, chunk_begin, chunk_end);
+		}
+	} while (steal(own_slot));
+}
+
+/**
+ * @brief Take a chunk from the front of a slot.
+ *
+ * @param slot The slot to take the chunk from.
+ * @param chunk_begin Output for the first index of the chunk.
+ * @param chunk_end Output for the index after the chunk.
+ * @returns If the slot still had work.
+ */
+bool ThreadPool::pop(unsigned int slot, size_t &chunk_begin, size_t &chunk_end)
+{
+	Slot &s = slots[slot];
+	while (s.lock.test_and_set(std::memory_order_acquire))
+		;
+
+	bool found = s.begin < s.end;
+	if (found)
+	{
+		chunk_begin = s.begin;
+		chunk_end = std::min(s.begin + job_grain, s.end);
+		s.begin = chunk_end;
+	}
+
+	s.lock.clear(std::memory_order_release);
+	return found;
+}
+
+/**
+ * @brief Move the back half of another slot's remaining range into the own slot.
+ *
+ * @param thief The slot of the stealing thread.
+ * @returns If any work could be stolen.
+ */
+bool ThreadPool::steal(unsigned int thief)
+{
+	size_t stolen_begin = 0;
+	size_t stolen_end = 0;
+	unsigned int thread_count = get_thread_count();
+	for (unsigned int offset = 1; offset < thread_count; offset++)
+	{
+		Slot &victim = slots[(thief + offset) % thread_count];
+		while (victim.lock.test_and_set(std::memory_order_acquire))
+			;
+
+		size_t remaining = victim.end - std::min(victim.begin, victim.end);
+		bool found = remaining > 0;
+		if (found)
+		{
+			// Take half of the remaining work, or all of it if it is only a few chunks.
+			size_t stolen = remaining > 2 * job_grain ? remaining / 2 : remaining;
+			stolen_begin = victim.end - stolen;
+			stolen_end = victim.end;
+			victim.end = stolen_begin;
+		}
+		victim.lock.clear(std::memory_order_release);
+
+		if (found)
+		{
+			Slot &own = slots[thief];
+			while (own.lock.test_and_set(std::memory_order_acquire))
+				;
+			own.begin = stolen_begin;
+			own.end = stolen_end;
+			own.lock.clear(std::memory_order_release);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Spin for a while until the generation changes, then sleep.
+ * Parked workers sleep immediately.
+ *
+ * @param seen_generation The last generation the worker handled.
+ */
+void ThreadPool::wait_for_work(unsigned long long seen_generation)
+{
+	if (!parked.load())
+	{
+		for (int i = 0; i < spin_count; i++)
+		{
+			if (generation.load(std::memory_order_acquire) != seen_generation)
+				return;
+			std::this_thread::yield();
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	wake_up.wait(lock, [&]()
+				 { return generation.load() != seen_generation; });
+}
+
+/**
+ * @brief Main loop of a worker. Waits for loops and tasks until the pool is destroyed.
+ *
+ * @param slot The slot of this worker.
+ * @param cpu The CPU to pin this worker to, or -1.
+ */
+void ThreadPool::worker_loop(unsigned int slot, int cpu)
+{
+	current_pool = this;
+	current_slot = slot;
+	if (cpu >= 0)
+		pin_current_thread(cpu);
+
+	unsigned long long seen_generation = 0;
+	while (true)
+	{
+		wait_for_work(seen_generation);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (stop)
+			return;
+		seen_generation = generation.load();
+
+		if (async_pending)
+		{
+			async_pending = false;
+			async_running = true;
+			std::function<void()> task = std::move(async_task);
+			lock.unlock();
+
+			task();
+
+			lock.lock();
+			async_running = false;
+			async_done.notify_all();
+			continue;
+		}
+
+		// The loop might have finished while this worker was busy.
+		if (job.object == nullptr)
+			continue;
+
+		active_workers++;
+		AllocationRegion region = job_region;
+		lock.unlock();
+
+		{
+			AllocationScope scope(region);
+			run_slots(slot);
+		}
+
+		lock.lock();
+		active_workers--;
+		if (active_workers == 0)
+			job_done.notify_all();
+	}
+}
+
+/**
+ * @brief Restrict the calling thread to a single CPU.
+ * Does nothing on platforms without affinity support.
+ *
+ * @param cpu The index of the CPU.
+ */
+void ThreadPool::pin_current_thread(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+	SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#else
+	(void)cpu;
+#endif
+}
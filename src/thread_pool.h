@@ -0,0 +1,102 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "allocation_tracker.h"
+
+/**
+ * A fixed set of worker threads executing fork-join parallel loops.
+ * Every loop is split evenly between the threads. A thread that finished its part
+ * steals half of the remaining indices of another thread, so uneven work is balanced.
+ * The calling thread takes part in every loop, so a pool with a thread count
+ * of n spawns n - 1 workers. A thread count of 1 runs everything inline.
+ * @brief Work stealing thread pool for data parallel loops.
+ */
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int thread_count = std::thread::hardware_concurrency(), const std::vector<int> &affinity = {});
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+	~ThreadPool();
+
+	unsigned int get_thread_count() const;
+
+	// Splits [begin, end) into chunks of at least grain_size elements and calls
+	// func(chunk_begin, chunk_end) for each of them. Blocks until all chunks are done.
+	// Only one loop may run at a time. func is referenced, not copied, so no allocation happens.
+	template <typename Func>
+	void parallel_for(size_t begin, size_t end, const Func &func, size_t grain_size = 256)
+	{
+		LoopBody body;
+		body.object = &func;
+		body.call = [](const void *object, size_t chunk_begin, size_t chunk_end)
+		{ (*static_cast<const Func *>(object))(chunk_begin, chunk_end); };
+		run_loop(begin, end, body, grain_size);
+	}
+
+	// Runs a task on one of the workers without blocking the caller.
+	// The task may start parallel loops. Only one task may be pending at a time.
+	void run_async(std::function<void()> task);
+	// Blocks until the task started with run_async finished.
+	void wait_async();
+
+	// Parked workers sleep right after a loop instead of spinning for the next one.
+	void set_parked(bool parked);
+
+private:
+	// Non-owning reference to the function called for the chunks of a loop.
+	struct LoopBody
+	{
+		const void *object;
+		void (*call)(const void *object, size_t chunk_begin, size_t chunk_end);
+	};
+
+	// Remaining index range of one thread. Aligned to a cache line
+	// to avoid false sharing between the threads.
+	struct alignas(64) Slot
+	{
+		std::atomic_flag lock = ATOMIC_FLAG_INIT;
+		size_t begin = 0;
+		size_t end = 0;
+	};
+
+	std::vector<std::thread> workers;
+	// One slot per thread, slot 0 belongs to the thread calling parallel_for.
+	std::unique_ptr<Slot[]> slots;
+
+	std::mutex mutex;
+	std::condition_variable wake_up;
+	std::condition_variable job_done;
+	bool stop = false;
+	std::atomic<bool> parked;
+
+	// Incremented for every loop and task, so sleeping workers notice them.
+	std::atomic<unsigned long long> generation;
+
+	// The current loop.
+	LoopBody job = {nullptr, nullptr};
+	size_t job_grain = 0;
+	// Region of the thread starting the loop, the workers count their allocations to it.
+	AllocationRegion job_region = UNSCOPED;
+	unsigned int active_workers = 0;
+
+	// The current asynchronous task.
+	std::function<void()> async_task;
+	bool async_pending = false;
+	bool async_running = false;
+	std::condition_variable async_done;
+
+	void run_loop(size_t begin, size_t end, LoopBody body, size_t grain_size);
+	void worker_loop(unsigned int slot, int cpu);
+	void run_slots(unsigned int own_slot);
+	bool pop(unsigned int slot, size_t &chunk_begin, size_t &chunk_end);
+	bool steal(unsigned int thief);
+	void wait_for_work(unsigned long long seen_generation);
+
+	static void pin_current_thread(int cpu);
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+
+/**
+ * Hands off values from one writer thread to one reader thread without locks.
+ * The writer fills the back buffer and publishes it, the reader takes the most
+ * recently published buffer. Neither side ever waits for the other, intermediate
+ * values are dropped if the writer is faster than the reader.
+ * @brief Lock-free single producer, single consumer triple buffer.
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() = default;
+	TripleBuffer(const TripleBuffer &) = delete;
+	TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+	// Writer side: the buffer to fill next.
+	inline T &get_back()
+	{
+		return buffers[back];
+	}
+
+	// Writer side: make the back buffer available to the reader.
+	inline void publish()
+	{
+		back = middle.exchange(back | fresh_bit, std::memory_order_acq_rel) & index_mask;
+	}
+
+	// Reader side: move the most recently published buffer to the front.
+	// Returns false if nothing was published since the last call.
+	inline bool update_front()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & fresh_bit))
+			return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & index_mask;
+		return true;
+	}
+
+	// Reader side: the most recently taken buffer.
+	inline const T &get_front() const
+	{
+		return buffers[front];
+	}
+
+private:
+	// The middle index carries a flag telling if it holds a value the reader has not seen yet.
+	static constexpr unsigned char fresh_bit = 4;
+	static constexpr unsigned char index_mask = 3;
+	static_assert(std::atomic<unsigned char>::is_always_lock_free);
+
+	T buffers[3];
+	unsigned char back = 0;
+	std::atomic<unsigned char> middle{1};
+	unsigned char front = 2;
+};
@@ -0,0 +1,594 @@
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <span>
+#include <vector>
+#include <thread>
+#include "allocation_tracker.h"
+#include "cloth_state.h"
+#include "huge_page_allocator.h"
+#include "physics_engine.h"
+
+/**
+ * @brief Command line options of the headless benchmark.
+ */
+struct BenchOptions
+{
+    std::string mesh_path = "assets/cloth_50.obj";
+    std::string pin_path;
+    VertexOrdering ordering = VertexOrdering::FILE_ORDER;
+    int frames = 100;
+    int substeps = 20;
+    float delta_time = 1.0f / 60.0f;
+    MountingType mount = MountingType::CORNER_VERTEX;
+    ConstraintSolver solver = ConstraintSolver::GAUSS_SEIDEL;
+    int iterations = 1;
+    int jacobi_sweeps = 6;
+    float rho = 0.9f;
+    float skin = 2.0f;
+    int exclude_rings = 1;
+    bool self_collision = true;
+    bool specialized_step = true;
+    BroadPhaseType broad_phase = BroadPhaseType::SPATIAL_HASH;
+    SpatialHashMode hash_mode = SpatialHashMode::SPARSE_TABLE;
+    float hash_rebuild = 0.1f;
+    SimdLevel simd_level = detect_simd_level();
+    unsigned int threads = std::thread::hardware_concurrency();
+    std::vector<int> affinity;
+    // Frames before the heap allocations are checked, -1 disables the check.
+    int allocation_warmup = -1;
+    // CSV file for the phase timings, empty for none.
+    std::string profile_path;
+    // Solver whose strain the run is compared to, if compare is set.
+    bool compare = false;
+    ConstraintSolver compare_solver = ConstraintSolver::GAUSS_SEIDEL;
+};
+
+// A solver passes the comparison if its strain is at most this many times the strain of the other solver.
+const double max_strain_ratio = 1.5;
+
+/**
+ * @brief Print the usage text of the benchmark.
+ */
+void print_usage()
+{
+    std::cout << "Usage: XPBDClothBench [options]" << std::endl
+              << "  --mesh <path>      obj file to simulate (default: assets/cloth_50.obj)" << std::endl
+              << "  --order <type>     file | morton, order of the vertices in memory (default: file)" << std::endl
+              << "  --frames <n>       number of frames to simulate (default: 100)" << std::endl
+              << "  --substeps <n>     substeps per frame (default: 20)" << std::endl
+              << "  --dt <seconds>     fixed time step per frame (default: 1/60)" << std::endl
+              << "  --mount <type>     corner | top | middle | none | pins (default: corner)" << std::endl
+              << "  --pins <path>      file with 1-based vertex indices to pin, implies --mount pins" << std::endl
+              << "                     (default: <mesh>.pins, if it exists)" << std::endl
+              << "  --solver <type>    gauss-seidel | colored | jacobi | vectorized (default: gauss-seidel)" << std::endl
+              << "  --iterations <n>   constraint iterations per substep (default: 1)" << std::endl
+              << "  --jacobi-sweeps <n> jacobi iterations per constraint iteration (default: 6)" << std::endl
+              << "  --rho <value>      Chebyshev spectral radius for jacobi, 0 disables, at most " << max_chebyshev_rho << " (default: 0.9)" << std::endl
+              << "  --skin <value>     self collision neighbor list skin in particle radii, 0 disables (default: 2)" << std::endl
+              << "  --collide <on|off> collisions between the particles of the cloth (default: on)" << std::endl
+              << "  --exclude <rings>  mesh rings around a particle it does not collide with, 0 none (default: 1)" << std::endl
+              << "  --broad-phase <t>  hash | grid | sap, how self collision candidates are found (default: hash)" << std::endl
+              << "  --hash <type>      sparse | compact storage of the self collision spatial hash (default: sparse)" << std::endl
+              << "  --hash-rebuild <f> fraction of particles changing cells before the spatial hash is rebuilt" << std::endl
+              << "                     instead of updated, 0 always rebuilds (default: 0.1)" << std::endl
+              << "  --simd <type>      scalar | sse | avx2 | avx512 for vectorized (default: widest supported)" << std::endl
+              << "  --step <type>      specialized | generic, substep compiled for the settings or checking" << std::endl
+              << "                     them at run time (default: specialized)" << std::endl
+              << "  --threads <n>      threads used by the parallel solvers (default: all cores)" << std::endl
+              << "  --affinity <list>  comma separated CPUs to pin the threads to, e.g. 0,2,4,6" << std::endl
+              << "  --profile <path>   print the time per frame of every phase and write it to a CSV file" << std::endl
+              << "  --compare <solver> also run the given solver and fail if the strain of the first one is" << std::endl
+              << "                     more than " << max_strain_ratio << " times as large" << std::endl
+              << "  --check-allocations <n>" << std::endl
+              << "                     fail if a frame after the first n frames allocates heap memory," << std::endl
+              << "                     needs a build with XPBD_TRACK_ALLOCATIONS" << std::endl
+              << "  --help             print this help" << std::endl;
+}
+
+/**
+ * @param name The mount name given on the command line.
+ * @param mount Output for the parsed mount.
+ * @returns If the name was a valid mount.
+ *
+ * @brief Converts a mount name into its mounting type.
+ */
+bool parse_mount(const std::string &name, MountingType &mount)
+{
+    if (name == "corner")
+        mount = MountingType::CORNER_VERTEX;
+    else if (name == "top")
+        mount = MountingType::TOP_ROW;
+    else if (name == "middle")
+        mount = MountingType::MIDDLE_VERTEX;
+    else if (name == "none")
+        mount = MountingType::UNCONSTRAINED;
+    else if (name == "pins")
+        mount = MountingType::PIN_SET;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * @param name The solver name given on the command line.
+ * @param solver Output for the parsed solver.
+ * @returns If the name was a valid solver.
+ *
+ * @brief Converts a solver name into its constraint solver.
+ */
+bool parse_solver(const std::string &name, ConstraintSolver &solver)
+{
+    if (name == "gauss-seidel")
+        solver = ConstraintSolver::GAUSS_SEIDEL;
+    else if (name == "colored")
+        solver = ConstraintSolver::GRAPH_COLORED;
+    else if (name == "jacobi")
+        solver = ConstraintSolver::JACOBI;
+    else if (name == "vectorized")
+        solver = ConstraintSolver::VECTORIZED;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * @param name The broad phase name given on the command line.
+ * @param type Output for the parsed broad phase.
+ * @returns If the name was a valid broad phase.
+ *
+ * @brief Converts a broad phase name into its type.
+ */
+bool parse_broad_phase(const std::string &name, BroadPhaseType &type)
+{
+    if (name == "hash")
+        type = BroadPhaseType::SPATIAL_HASH;
+    else if (name == "grid")
+        type = BroadPhaseType::DENSE_GRID;
+    else if (name == "sap")
+        type = BroadPhaseType::SWEEP_AND_PRUNE;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * @param name The instruction set name given on the command line.
+ * @param level Output for the parsed instruction set.
+ * @returns If the name was a valid instruction set.
+ *
+ * @brief Converts an instruction set name into its SIMD level.
+ */
+bool parse_simd_level(const std::string &name, SimdLevel &level)
+{
+    for (SimdLevel candidate : {SimdLevel::SCALAR, SimdLevel::SSE, SimdLevel::AVX2, SimdLevel::AVX512})
+    {
+        if (name == get_simd_level_name(candidate))
+        {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @param text The number given on the command line.
+ * @param value Output for the parsed number.
+ * @returns If the whole text is a number of the type of value. Unsigned types reject
+ * a minus sign, and numbers out of the range of the type are rejected.
+ *
+ * @brief Converts a command line value into a number.
+ */
+template <typename T>
+bool parse_number(const std::string &text, T &value)
+{
+    const char *end = text.data() + text.size();
+    auto [last, error] = std::from_chars(text.data(), end, value);
+    return error == std::errc() && last == end;
+}
+
+/**
+ * @param list Comma separated CPU indices.
+ * @param affinity Output for the parsed CPU indices.
+ * @returns If the list was valid.
+ *
+ * @brief Parses a list of CPU indices.
+ */
+bool parse_affinity(const std::string &list, std::vector<int> &affinity)
+{
+    std::stringstream stream(list);
+    std::string cpu;
+    affinity.clear();
+    while (std::getline(stream, cpu, ','))
+    {
+        if (cpu.empty())
+            return false;
+        int index;
+        if (!parse_number(cpu, index) || index < 0)
+            return false;
+        affinity.push_back(index);
+    }
+    return !affinity.empty();
+}
+
+/**
+ * @param argc Number of command line arguments.
+ * @param argv The command line arguments.
+ * @param options Output for the parsed options.
+ * @returns If all arguments could be parsed.
+ *
+ * @brief Parses the command line arguments of the benchmark.
+ */
+bool parse_options(int argc, char **argv, BenchOptions &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--help")
+            return false;
+
+        // All remaining options take exactly one value.
+        if (i + 1 >= argc)
+        {
+            std::cout << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        // Set to false by the numeric options if their value is not a number.
+        bool valid = true;
+
+        if (arg == "--mesh")
+            options.mesh_path = value;
+        else if (arg == "--pins")
+        {
+            options.pin_path = value;
+            options.mount = MountingType::PIN_SET;
+        }
+        else if (arg == "--order")
+        {
+            if (value == "file")
+                options.ordering = VertexOrdering::FILE_ORDER;
+            else if (value == "morton")
+                options.ordering = VertexOrdering::MORTON_ORDER;
+            else
+            {
+                std::cout << "Unknown vertex order: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--frames")
+            valid = parse_number(value, options.frames);
+        else if (arg == "--substeps")
+            valid = parse_number(value, options.substeps);
+        else if (arg == "--dt")
+            valid = parse_number(value, options.delta_time);
+        else if (arg == "--mount")
+        {
+            if (!parse_mount(value, options.mount))
+            {
+                std::cout << "Unknown mount: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--solver")
+        {
+            if (!parse_solver(value, options.solver))
+            {
+                std::cout << "Unknown solver: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--iterations")
+            valid = parse_number(value, options.iterations);
+        else if (arg == "--jacobi-sweeps")
+            valid = parse_number(value, options.jacobi_sweeps);
+        else if (arg == "--rho")
+            valid = parse_number(value, options.rho);
+        else if (arg == "--skin")
+            valid = parse_number(value, options.skin);
+        else if (arg == "--collide")
+        {
+            if (value != "on" && value != "off")
+            {
+                std::cout << "Expected on or off: " << value << std::endl;
+                return false;
+            }
+            options.self_collision = value == "on";
+        }
+        else if (arg == "--exclude")
+            valid = parse_number(value, options.exclude_rings);
+        else if (arg == "--broad-phase")
+        {
+            if (!parse_broad_phase(value, options.broad_phase))
+            {
+                std::cout << "Unknown broad phase: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--hash")
+        {
+            if (value == "sparse")
+                options.hash_mode = SpatialHashMode::SPARSE_TABLE;
+            else if (value == "compact")
+                options.hash_mode = SpatialHashMode::COMPACT;
+            else
+            {
+                std::cout << "Unknown hash mode: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--hash-rebuild")
+            valid = parse_number(value, options.hash_rebuild);
+        else if (arg == "--simd")
+        {
+            if (!parse_simd_level(value, options.simd_level))
+            {
+                std::cout << "Unknown instruction set: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--step")
+        {
+            if (value != "specialized" && value != "generic")
+            {
+                std::cout << "Unknown substep: " << value << std::endl;
+                return false;
+            }
+            options.specialized_step = value == "specialized";
+        }
+        else if (arg == "--threads")
+            valid = parse_number(value, options.threads);
+        else if (arg == "--affinity")
+        {
+            if (!parse_affinity(value, options.affinity))
+            {
+                std::cout << "Invalid CPU list: " << value << std::endl;
+                return false;
+            }
+        }
+        else if (arg == "--profile")
+            options.profile_path = value;
+        else if (arg == "--compare")
+        {
+            if (!parse_solver(value, options.compare_solver))
+            {
+                std::cout << "Unknown solver: " << value << std::endl;
+                return false;
+            }
+            options.compare = true;
+        }
+        else if (arg == "--check-allocations")
+            valid = parse_number(value, options.allocation_warmup);
+        else
+        {
+            std::cout << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+
+        if (!valid)
+        {
+            std::cout << "Invalid number for " << arg << ": " << value << std::endl;
+            return false;
+        }
+    }
+
+    return options.frames > 0 && options.substeps > 0 && options.delta_time > 0.0f && options.threads > 0 &&
+           options.iterations > 0 && options.jacobi_sweeps > 0 && options.rho >= 0.0f && options.rho <= max_chebyshev_rho &&
+           options.skin >= 0.0f && options.exclude_rings >= 0 && options.hash_rebuild >= 0.0f && options.hash_rebuild <= 1.0f &&
+           options.allocation_warmup >= -1 && options.allocation_warmup < options.frames;
+}
+
+/**
+ * @brief Apply the simulation settings of the options to an engine.
+ *
+ * @param engine The engine to configure
+ * @param options The parsed options
+ * @param solver The constraint solver to use
+ */
+void configure_engine(PhysicsEngine &engine, const BenchOptions &options, ConstraintSolver solver)
+{
+    engine.set_substeps(options.substeps);
+    engine.set_constraint_solver(solver);
+    engine.set_solver_iterations(options.iterations);
+    engine.set_jacobi_sweeps(options.jacobi_sweeps);
+    engine.set_chebyshev_rho(options.rho);
+    engine.set_neighbor_skin(options.skin);
+    engine.set_collision_exclusion_rings(options.exclude_rings);
+    engine.set_self_collision(options.self_collision);
+    engine.set_specialized_step(options.specialized_step);
+    engine.set_broad_phase(options.broad_phase);
+    engine.set_spatial_hash_mode(options.hash_mode);
+    engine.set_spatial_hash_rebuild_fraction(options.hash_rebuild);
+    engine.set_simd_level(options.simd_level);
+    engine.set_thread_count(options.threads);
+    engine.set_thread_affinity(options.affinity);
+}
+
+/**
+ * @param cloth The simulated cloth.
+ * @returns The mean relative deviation of the springs from their rest distance.
+ */
+double get_mean_strain(const ClothState &cloth)
+{
+    std::span<const vec3> positions = cloth.get_vertex_positions();
+    const auto &springs = cloth.get_unique_springs_ref();
+    const huge_page_vector<float> &rest_distance = cloth.get_rest_distance_ref();
+    double strain = 0.0;
+    for (size_t i = 0; i < springs.size(); i++)
+    {
+        float distance = length(positions[springs[i].data[1]] - positions[springs[i].data[0]]);
+        strain += std::abs(distance - rest_distance[i]) / rest_distance[i];
+    }
+    return springs.empty() ? 0.0 : strain / springs.size();
+}
+
+/**
+ * @brief Simulate the mesh of the options with another solver.
+ *
+ * @param options The parsed options
+ * @param solver The constraint solver to use
+ * @return double The mean strain after all frames, see get_mean_strain()
+ */
+double simulate_strain(const BenchOptions &options, ConstraintSolver solver)
+{
+    ClothState cloth(options.mesh_path, options.ordering);
+    if (!options.pin_path.empty())
+        cloth.load_pinned_vertices(options.pin_path);
+    PhysicsEngine engine(&cloth, {0.f, -9.81f, 0.f}, options.mount);
+    configure_engine(engine, options, solver);
+    for (int frame = 0; frame < options.frames; frame++)
+        engine.update(options.delta_time);
+    return get_mean_strain(cloth);
+}
+
+// Runs the physics engine without a window and reports the time spent per frame.
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    if (!parse_options(argc, argv, options))
+    {
+        print_usage();
+        return 1;
+    }
+    bool check_allocations = options.allocation_warmup >= 0;
+    if (check_allocations && !allocation_tracking_enabled)
+    {
+        std::cout << "Allocation tracking is not compiled in, configure with -DXPBD_TRACK_ALLOCATIONS=ON." << std::endl;
+        return 1;
+    }
+
+    ClothState cloth(options.mesh_path, options.ordering);
+    if (cloth.get_vertex_positions().empty())
+    {
+        std::cout << "Mesh " << options.mesh_path << " contains no vertices." << std::endl;
+        return 1;
+    }
+    if (!options.pin_path.empty() && !cloth.load_pinned_vertices(options.pin_path))
+        return 1;
+
+    vec3 gravity = {0.f, -9.81f, 0.f};
+    PhysicsEngine engine(&cloth, gravity, options.mount);
+    configure_engine(engine, options, options.solver);
+
+    std::cout << "mesh: " << options.mesh_path
+              << ", vertices: " << cloth.get_vertex_positions().size()
+              << ", springs: " << cloth.get_unique_springs_ref().size()
+              << ", spring colors: " << cloth.get_spring_colors_ref().size()
+              << ", pinned: " << engine.get_pinned_count()
+              << ", substeps: " << options.substeps
+              << ", iterations: " << options.iterations
+              << ", simd: " << get_simd_level_name(engine.get_simd_level())
+              << ", threads: " << engine.get_thread_count()
+              << ", dt: " << options.delta_time << std::endl;
+    std::cout << (check_allocations ? "frame,ms,allocations,bytes" : "frame,ms") << std::endl;
+
+    double total_ms = 0.0;
+    double min_ms = 0.0;
+    double max_ms = 0.0;
+    // Allocations of the frames after the warm-up, per region.
+    AllocationCounts steady_allocations[ALLOCATION_REGION_COUNT];
+    for (int frame = 0; frame < options.frames; frame++)
+    {
+        reset_allocation_counts();
+        auto start = std::chrono::steady_clock::now();
+        engine.update(options.delta_time);
+        auto end = std::chrono::steady_clock::now();
+
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        if (check_allocations)
+        {
+            AllocationCounts frame_allocations = get_total_allocation_counts();
+            std::cout << frame << "," << ms << "," << frame_allocations.allocations << "," << frame_allocations.bytes << std::endl;
+            for (int region = 0; region < ALLOCATION_REGION_COUNT && frame >= options.allocation_warmup; region++)
+            {
+                AllocationCounts counts = get_allocation_counts(static_cast<AllocationRegion>(region));
+                steady_allocations[region].allocations += counts.allocations;
+                steady_allocations[region].bytes += counts.bytes;
+            }
+        }
+        else
+            std::cout << frame << "," << ms << std::endl;
+
+        total_ms += ms;
+        min_ms = frame == 0 ? ms : std::min(min_ms, ms);
+        max_ms = frame == 0 ? ms : std::max(max_ms, ms);
+    }
+
+    std::cout << "total: " << total_ms << " ms"
+              << ", mean: " << total_ms / options.frames << " ms"
+              << ", min: " << min_ms << " ms"
+              << ", max: " << max_ms << " ms" << std::endl;
+    double strain = get_mean_strain(cloth);
+    std::cout << "mean strain: " << strain << std::endl;
+    if (!options.profile_path.empty())
+    {
+        std::ofstream file(options.profile_path);
+        if (!file)
+        {
+            std::cout << "Could not write " << options.profile_path << std::endl;
+            return 1;
+        }
+        const PhaseProfiler &profiler = engine.get_profiler();
+        std::cout << "phase timings of the last " << std::min<size_t>(options.frames, profiler.get_window()) << " frames:" << std::endl;
+        PhaseProfiler::write_csv_header(std::cout);
+        profiler.write_csv(std::cout);
+        PhaseProfiler::write_csv_header(file);
+        profiler.write_csv(file);
+    }
+
+    HugePageStatistics huge_pages = get_huge_page_statistics();
+    std::cout << "huge pages: " << huge_pages.huge_pages
+              << ", backing " << huge_pages.huge_page_bytes / (1024 * 1024)
+              << " of " << huge_pages.mapped_bytes / (1024 * 1024) << " MiB in "
+              << huge_pages.mappings << " large arrays" << std::endl;
+
+    if (check_allocations)
+    {
+        unsigned long long steady_total = 0;
+        for (int region = 0; region < ALLOCATION_REGION_COUNT; region++)
+        {
+            steady_total += steady_allocations[region].allocations;
+            if (steady_allocations[region].allocations > 0)
+                std::cout << "  " << get_allocation_region_name(static_cast<AllocationRegion>(region))
+                          << ": " << steady_allocations[region].allocations << " allocations, "
+                          << steady_allocations[region].bytes << " bytes" << std::endl;
+        }
+        std::cout << "allocations after " << options.allocation_warmup << " warm-up frames: " << steady_total << std::endl;
+        if (steady_total > 0)
+            return 1;
+    }
+    if (options.compare)
+    {
+        double compare_strain = simulate_strain(options, options.compare_solver);
+        std::cout << "mean strain of the compared solver: " << compare_strain
+                  << ", ratio: " << strain / compare_strain << std::endl;
+        if (!(strain <= max_strain_ratio * compare_strain))
+            return 1;
+    }
+    if (!options.self_collision)
+        return 0;
+    if (options.skin > 0.0f)
+        std::cout << "neighbor list rebuilds: " << engine.get_neighbor_list_rebuilds()
+                  << " in " << options.frames * options.substeps << " substeps" << std::endl;
+
+    if (options.broad_phase != BroadPhaseType::SPATIAL_HASH)
+        return 0;
+    SpatialHashStatistics hash = engine.get_spatial_hash_statistics();
+    std::cout << "spatial hash: " << (options.hash_mode == SpatialHashMode::COMPACT ? "compact" : "sparse")
+              << ", occupied cells: " << hash.occupied_cells
+              << ", table size: " << hash.table_size
+              << ", load factor: " << hash.load_factor
+              << ", mean chain: " << hash.mean_chain_length
+              << ", max chain: " << hash.max_chain_length
+              << ", memory: " << hash.memory_bytes << " bytes"
+              << ", updates: " << hash.incremental_updates
+              << ", rebuilds: " << hash.full_rebuilds << std::endl;
+
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include "xpbd_window.h"
 #include <cassert>
 
+// File the phase timings are written to, on key t and when the window closes.
+static const char *profile_path = "profile.csv";
+
 /**
  * This function creates a glfw window and sets up the XPBD cloth simulation.
  * This class handles rendering and window inputs.
@@ -84,6 +87,7 @@ XPBDWindow::XPBDWindow()
  */
 XPBDWindow::~XPBDWindow()
 {
+    write_profile();
     glfwTerminate();
 }
 
@@ -238,7 +242,10 @@ void XPBDWindow::handle_key_input(GLFWwindow *window, int key, int scancode, int
         // Pause / start simulation.
     case GLFW_KEY_P:
         if (action == GLFW_PRESS)
+        {
             simulate = !simulate;
+            cloth_physics->set_paused(!simulate);
+        }
         break;
         // Adjust movement speed.
     case GLFW_KEY_RIGHT_BRACKET:
@@ -266,9 +273,10 @@ void XPBDWindow::handle_key_input(GLFWwindow *window, int key, int scancode, int
     case GLFW_KEY_2:
     case GLFW_KEY_3:
     case GLFW_KEY_4:
+    case GLFW_KEY_5:
         if (action == GLFW_PRESS)
         {
-            mounting_type = static_cast<MountingType>(key);
+            mounting_type = static_cast<MountingType>(key - GLFW_KEY_1);
             reset_cloth();
         }
         break;
@@ -285,6 +293,22 @@ void XPBDWindow::handle_key_input(GLFWwindow *window, int key, int scancode, int
         }
         break;
 
+        // Toggle the self collision. The engine is built for it, so start over.
+    case GLFW_KEY_C:
+        if (action == GLFW_PRESS)
+        {
+            self_collision = !self_collision;
+            std::cout << "self collision: " << (self_collision ? "on" : "off") << std::endl;
+            reset_cloth();
+        }
+        break;
+
+        // Write the phase timings.
+    case GLFW_KEY_T:
+        if (action == GLFW_PRESS)
+            write_profile();
+        break;
+
         // Print the help text.
     case GLFW_KEY_H:
         if (action == GLFW_PRESS)
@@ -315,6 +339,19 @@ void XPBDWindow::handle_key_input(GLFWwindow *window, int key, int scancode, int
     }
 }
 
+/**
+ * @brief Write the time per frame spent in the phases of the physics engine and of
+ * drawing the cloth, over the recent frames, as CSV.
+ */
+void XPBDWindow::write_profile()
+{
+    std::ofstream file(profile_path);
+    PhaseProfiler::write_csv_header(file);
+    cloth_physics->get_profiler().write_csv(file);
+    render_profiler.write_csv(file);
+    std::cout << "phase timings written to " << profile_path << std::endl;
+}
+
 /**
  * @brief Print the help text for the simulation.
  */
@@ -332,6 +369,8 @@ void XPBDWindow::print_help()
     std::cout << "p:   pause simulation" << std::endl;
     std::cout << "r:   reset the experiment" << std::endl;
     std::cout << "f:   toggle wireframe" << std::endl;
+    std::cout << "c:   toggle self collision and reset" << std::endl;
+    std::cout << "t:   write the phase timings to " << profile_path << std::endl;
     std::cout << "ESC: free the mouse" << std::endl;
 
     std::cout << "   ---MOUNTING METHODS---" << std::endl
@@ -339,6 +378,7 @@ void XPBDWindow::print_help()
               << "2: top row" << std::endl
               << "3: middle vertex" << std::endl
               << "4: none" << std::endl
+              << "5: pin set of the mesh (<mesh>.pins)" << std::endl
               << "   ---MOUNTING METHODS---" << std::endl;
 
     std::cout << "   ---MESH RESOLUTIONS---" << std::endl
@@ -358,6 +398,9 @@ void XPBDWindow::print_help()
  */
 void XPBDWindow::reset_cloth()
 {
+    // The old engine may still be working on the old cloth.
+    cloth_physics.reset();
+
     // Create the cloth and give it a color.
     vec3 color = {1.0f, 0.0f, 0.0f};
     switch (mesh_id)
@@ -399,10 +442,12 @@ void XPBDWindow::reset_cloth()
     MountingType m = static_cast<MountingType>(mounting_type);
 
 #ifdef USE_CONCURRENT_PHYSICS_ENGINE
-    cloth_physics = std::make_unique<ConcurrentPhysicsEngine>(cloth.get(), gravity, m);
+    cloth_physics = std::make_unique<ConcurrentPhysicsEngine>(cloth.get(), gravity, m, self_collision);
 #else
     cloth_physics = std::make_unique<PhysicsEngine>(cloth.get(), gravity, m);
+    cloth_physics->set_self_collision(self_collision);
 #endif
+    cloth_physics->set_paused(!simulate);
 }
 
 /**
@@ -426,6 +471,8 @@ void XPBDWindow::initialize_members()
 
     mounting_type = MountingType::CORNER_VERTEX;
     mesh_id = GLFW_KEY_F3;
+    self_collision = true;
+    simulate = false;
 
     // Set up the cloth in the scene.
     reset_cloth();
@@ -433,7 +480,6 @@ void XPBDWindow::initialize_members()
     delta_time = 0.0f;
     last_frame = 0.0f;
 
-    simulate = false;
     draw_wire_frame = true;
 
     // Create a shader for the objects in the scene.
@@ -468,8 +514,12 @@ void XPBDWindow::render()
 
     if (curr_frame - last_fps_print >= 1.f)
     {
+        PhaseStatistics update = cloth_physics->get_profiler().get_statistics(ProfilePhase::PROFILE_UPDATE);
+        PhaseStatistics draw = render_profiler.get_statistics(ProfilePhase::PROFILE_DRAW);
         std::stringstream ss;
-        ss << "XPBD Cloth simulation FPS: " << 1 / delta_time;
+        ss << "XPBD Cloth simulation FPS: " << 1 / delta_time
+           << ", physics: " << update.mean << " ms (p99 " << update.p99 << " ms)"
+           << ", draw: " << draw.mean << " ms";
         glfwSetWindowTitle(window, ss.str().c_str());
         last_fps_print = curr_frame;
     }
@@ -503,23 +553,29 @@ void XPBDWindow::render()
  */
 void XPBDWindow::update_window()
 {
+    frame_arena.reset();
     render();
 
 #ifdef USE_CONCURRENT_PHYSICS_ENGINE
     if (simulate)
     {
-        cloth_physics->wait();
+        // Show the newest frame the physics thread finished. Never blocks.
+        cloth_physics->update();
     }
 #endif
 
     // Draw the cloth onto the screen.
-    cloth->draw();
+    render_profiler.begin_frame();
+    cloth->draw(&frame_arena, &render_profiler);
+    render_profiler.end_frame();
 
+#ifndef USE_CONCURRENT_PHYSICS_ENGINE
     if (simulate)
     {
         // Implements the physics engine.
         cloth_physics->update();
     }
+#endif
 
     // Gives the window the new buffer updated with glClear.
     glfwSwapBuffers(window);
@@ -6,6 +6,8 @@
 #include "shader.h"
 #include "linear_algebra.h"
 #include "camera.h"
+#include "frame_arena.h"
+#include "phase_profiler.h"
 
 // #define USE_CONCURRENT_PHYSICS_ENGINE
 
@@ -28,6 +30,7 @@ private:
 	void initialize_members();
 
 	void print_help();
+	void write_profile();
 	void reset_cloth();
 	void render();
 
@@ -46,6 +49,10 @@ private:
 #endif
 	std::unique_ptr<Shader> shader;
 	std::unique_ptr<Camera> camera;
+	// Temporaries of the current frame, reset at the start of every frame.
+	FrameArena frame_arena;
+	// Time spent drawing the cloth, the physics engine profiles itself.
+	PhaseProfiler render_profiler;
 
 	double delta_time;
 	double last_frame;
@@ -64,6 +71,7 @@ private:
 
 	MountingType mounting_type;
 	int mesh_id;
+	bool self_collision;
 
 	vec3 position;
 	vec3 rotation;